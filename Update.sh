@@ -1,4 +1,6 @@
 #!/bin/bash
 rm main.c
 wget http://$1/SmartUmbrellaCan/main.c
+rm evlog.h
+wget http://$1/SmartUmbrellaCan/evlog.h
 make board=galileo
\ No newline at end of file
@@ -0,0 +1,90 @@
+/*
+ * Binary event log shared by main.c and the offline decoder evlog_decode.c
+ *
+ * The log is a memory-mapped file holding a header and a ring of fixed-size
+ * records. The station only stores raw values, evlog_decode renders the text.
+ */
+
+#ifndef EVLOG_H
+#define EVLOG_H
+
+#include <stdint.h>
+
+#define EVLOG_FILE            "events.bin"
+#define EVLOG_OLD_FILE        "events.old.bin" // a log of another version, moved aside at boot
+#define EVLOG_MAGIC           0x474C5645 // "EVLG"
+#define EVLOG_VERSION         2 // 2: EV_SELECT and EV_CARD_TYPE log the SAK instead of the card size and the ATQA
+#define EVLOG_VERSION_MIN     1 // oldest log evlog_decode reads, the record layout is the same
+#define EVLOG_CAPACITY        65536 // records, must be a power of 2 (1 MB file)
+
+/*
+ * Event list: X(id, format)
+ * The format takes the record arguments as positional parameters:
+ * %1$ = a (16 bits), %2$ = b (32 bits), %3$ = c (32 bits)
+ * A format may leave any of them out, evlog_decode prints each conversion on its own.
+ */
+#define EVLOG_EVENTS(X) \
+	X(EV_BOOT,            "boot, unix time %2$d") \
+	X(EV_WAIT_CARD,       "wait for a card") /* the field just emptied */ \
+	X(EV_NO_TAG,          "no tag error") /* no longer logged, the id stays */ \
+	X(EV_CARD_FOUND,      "find out a card, type 0x%1$04X") \
+	X(EV_CARD_TYPE,       "card type SAK 0x%1$02X, known %2$d, family %3$d") \
+	X(EV_SERIAL,          "card serial number %2$d (0x%2$08X)") \
+	X(EV_SELECT,          "card selected, SAK 0x%1$02X") \
+	X(EV_AUTH,            "authentication block %1$u, status %2$d") \
+	X(EV_READ,            "read block %1$u, status %2$d") \
+	X(EV_USER_STATUS,     "user status %2$d") \
+	X(EV_NO_STATUS,       "no user status information") \
+	X(EV_UMBRELLA,        "umbrella %1$u, ubl_1 %2$d, ubl_2 %3$d") \
+	X(EV_EMPTY,           "empty") \
+	X(EV_FULL,            "full") \
+	X(EV_UNLOCK,          "unlock slot %1$u") \
+	X(EV_LOCK,            "lock slot %1$u") \
+	X(EV_SLOT_CHANGE,     "slot changed, umbrella %1$u") \
+	X(EV_STATUS_QUERY,    "query user status %2$d") \
+	X(EV_RECORD_UPLOAD,   "upload record card %2$d, action %3$d") \
+	X(EV_SPI_DROP,        "SPI errors, drop back to clock step %1$u") \
+	X(EV_CARD_STATE,      "card record state %2$d, sequence %3$d") \
+	X(EV_CARD_STATE_WRITE, "write card record state %1$u, sequence %2$d, status %3$d") \
+	X(EV_QUOTA,           "borrows left on the card %2$d, status %3$d") \
+	X(EV_NO_QUOTA,        "card quota used up") \
+	X(EV_CARD_HELD,       "card of the last session, status %1$u, %2$d ms since its last answer") \
+	X(EV_BOOT_READY,      "first card poll %2$d ms after boot, reader attempts %1$u") \
+	X(EV_PROVISION,       "station keys written to trailer %1$u, status %2$d") \
+	X(EV_STALE_RECORD,    "card record sequence %2$d is older than the server knows") \
+	X(EV_NDEF_LAYOUT,     "NDEF data area %2$d bytes, %3$d in use, card record at page %1$u")
+
+// Formats of the events whose arguments differ in a version 1 log
+#define EVLOG_EVENTS_V1(X) \
+	X(EV_CARD_TYPE,       "card type 0x%1$04X, known %2$d") \
+	X(EV_SELECT,          "card size %1$uK bits")
+
+#define EVLOG_ENUM(id, format) id,
+enum
+{
+	EVLOG_EVENTS(EVLOG_ENUM)
+	EV_COUNT
+};
+#undef EVLOG_ENUM
+
+typedef struct
+{
+	uint32_t ms; // millis() at the event
+	uint16_t id; // EV_*
+	uint16_t a;
+	int32_t b;
+	int32_t c;
+} EvRecord;
+
+typedef struct
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t recordSize;
+	uint32_t capacity;
+	uint32_t reserved;
+	uint64_t head; // records written since the file was created, the next one goes to head % capacity
+	EvRecord records[EVLOG_CAPACITY];
+} EvRing;
+
+#endif
@@ -0,0 +1,179 @@
+/*
+ * Offline decoder for the station event log (evlog.h)
+ *
+ * Usage: evlog_decode [-f] [events.bin]
+ *        -f  keep following the log like tail -f
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "evlog.h"
+
+#define EVLOG_NAME(id, format) #id,
+#define EVLOG_FORMAT(id, format) format,
+const char *eventName[EV_COUNT] = { EVLOG_EVENTS(EVLOG_NAME) };
+const char *eventFormat[EV_COUNT] = { EVLOG_EVENTS(EVLOG_FORMAT) };
+#define EVLOG_FORMAT_V1(id, format) eventFormat[id] = format;
+
+long bootTime = 0; // unix time of the last EV_BOOT
+uint32_t bootMs = 0; // millis() of the last EV_BOOT
+
+/*
+ * Print an event format. Each %N$ conversion is handed to printf on its own without the
+ * position, printf itself refuses a positional format that leaves an argument out.
+ */
+void print_format(const char *fmt, const int *arg)
+{
+	char spec[16];
+	int n, len;
+
+	while(*fmt != '\0')
+	{
+		if(fmt[0] != '%' || fmt[1] == '%')
+		{
+			putchar(*fmt);
+			fmt += fmt[0] == '%' ? 2 : 1;
+			continue;
+		}
+		n = fmt[1] - '1';
+		if(n < 0 || n > 2 || fmt[2] != '$')
+		{
+			fputs(fmt, stdout); // not a positional conversion, print the rest as it is
+			return;
+		}
+		fmt += 3;
+		spec[0] = '%';
+		len = strspn(fmt, "-+ #0123456789");
+		if(len > (int)sizeof(spec) - 3)
+			len = sizeof(spec) - 3;
+		memcpy(spec + 1, fmt, len);
+		fmt += len;
+		spec[len + 1] = *fmt;
+		spec[len + 2] = '\0';
+		if(*fmt != '\0')
+			fmt++;
+		printf(spec, arg[n]);
+	}
+}
+
+void print_record(EvRecord *r)
+{
+	char stamp[32];
+	time_t t;
+	int arg[3];
+
+	if(r->id == EV_BOOT)
+	{
+		bootTime = r->b;
+		bootMs = r->ms;
+	}
+	if(bootTime != 0)
+	{
+		t = bootTime + (r->ms - bootMs) / 1000;
+		strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&t));
+		printf("%s.%03u ", stamp, (unsigned)(r->ms % 1000));
+	}
+	else
+	{
+		printf("%10u.%03u ", (unsigned)(r->ms / 1000), (unsigned)(r->ms % 1000));
+	}
+
+	if(r->id >= EV_COUNT)
+	{
+		printf("unknown event %u: %u %d %d\n", r->id, r->a, r->b, r->c);
+		return;
+	}
+	printf("%-18s ", eventName[r->id]);
+	arg[0] = r->a;
+	arg[1] = r->b;
+	arg[2] = r->c;
+	print_format(eventFormat[r->id], arg);
+	putchar('\n');
+}
+
+/* Read records [from, to) of the ring, return the new position */
+uint64_t print_range(FILE *fp, uint64_t from, uint64_t to)
+{
+	EvRecord r;
+	long offset;
+
+	if(to - from > EVLOG_CAPACITY)
+	{
+		printf("... %llu records overwritten ...\n", (unsigned long long)(to - from - EVLOG_CAPACITY));
+		from = to - EVLOG_CAPACITY;
+	}
+	for(; from < to; from++)
+	{
+		offset = offsetof(EvRing, records) + (from & (EVLOG_CAPACITY - 1)) * sizeof(EvRecord);
+		if(fseek(fp, offset, SEEK_SET) != 0 || fread(&r, sizeof(r), 1, fp) != 1)
+			break;
+		print_record(&r);
+	}
+	fflush(stdout);
+	return from;
+}
+
+int read_header(FILE *fp, EvRing *header)
+{
+	rewind(fp);
+	clearerr(fp);
+	return fread(header, offsetof(EvRing, records), 1, fp) == 1;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = EVLOG_FILE;
+	int follow = 0;
+	int i;
+	uint64_t pos;
+	EvRing header;
+	FILE *fp;
+
+	for(i = 1; i < argc; i++)
+	{
+		if(strcmp(argv[i], "-f") == 0)
+			follow = 1;
+		else
+			path = argv[i];
+	}
+
+	fp = fopen(path, "rb");
+	if(fp == NULL)
+	{
+		perror(path);
+		return 1;
+	}
+	if(!read_header(fp, &header) || header.magic != EVLOG_MAGIC)
+	{
+		fprintf(stderr, "%s: not an event log\n", path);
+		return 1;
+	}
+	if(header.version < EVLOG_VERSION_MIN || header.version > EVLOG_VERSION || header.capacity != EVLOG_CAPACITY || header.recordSize != sizeof(EvRecord))
+	{
+		fprintf(stderr, "%s: event log version %u is not supported\n", path, header.version);
+		return 1;
+	}
+	if(header.version == 1)
+	{
+		EVLOG_EVENTS_V1(EVLOG_FORMAT_V1)
+	}
+
+	pos = header.head > EVLOG_CAPACITY ? header.head - EVLOG_CAPACITY : 0;
+	pos = print_range(fp, pos, header.head);
+	while(follow)
+	{
+		usleep(200000);
+		if(!read_header(fp, &header))
+			continue;
+		if(header.head < pos) // the log was recreated
+			pos = 0;
+		if(header.head != pos)
+			pos = print_range(fp, pos, header.head);
+	}
+	fclose(fp);
+	return 0;
+}
@@ -0,0 +1,48 @@
+/*
+ * Minimal Arduino API for building main.c on a Linux host (make board=host)
+ *
+ * Time is virtual: delay() advances the clock instead of sleeping, and the
+ * SPI trace replay moves it to the recorded timestamps.
+ */
+
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+
+void init(int argc, char *argv[]);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+unsigned long millis(void);
+unsigned long micros(void);
+
+/* Serial goes to the file given to host_serial_open, a pty for a simulated node */
+class HardwareSerial
+{
+public:
+	void begin(unsigned long baud);
+	int available(void);
+	int read(void);
+	size_t write(uint8_t c);
+	size_t write(const uint8_t *buf, size_t len);
+};
+extern HardwareSerial Serial;
+
+/* Host only: set the virtual clock and the level seen by digitalRead on an input pin */
+void host_clock_set(unsigned long us);
+void host_pin_set(uint8_t pin, int val);
+void host_delay_hook(void (*hook)(unsigned long ms)); // called by delay() before the clock moves, NULL: none
+void host_serial_open(const char *path);
+
+#endif
@@ -0,0 +1,29 @@
+/*
+ * SPI stand-in for host builds, the bus is wired to the emulated MFRC522 in mfrc522_host.c
+ */
+
+#ifndef HOST_SPI_H
+#define HOST_SPI_H
+
+#include <stdint.h>
+
+#define SPI_CLOCK_DIV4 0x00
+#define SPI_CLOCK_DIV16 0x01
+#define SPI_CLOCK_DIV64 0x02
+#define SPI_CLOCK_DIV128 0x03
+#define SPI_CLOCK_DIV2 0x04
+#define SPI_CLOCK_DIV8 0x05
+#define SPI_CLOCK_DIV32 0x06
+
+class SPIClass
+{
+public:
+	void begin(void);
+	void end(void);
+	uint8_t transfer(uint8_t data);
+	void setClockDivider(uint8_t divider);
+};
+
+extern SPIClass SPI;
+
+#endif
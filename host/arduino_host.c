@@ -0,0 +1,179 @@
+/*
+ * Host implementation of the Arduino API used by main.c
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include "Arduino.h"
+#include "SPI.h"
+#include "mfrc522_host.h"
+
+#define HOST_PINS 32
+
+// One station per thread in the load generator, each with its own clock and pins
+__thread unsigned long hostClock = 0; // virtual micros()
+__thread int hostPins[HOST_PINS];
+__thread void (*hostDelayHook)(unsigned long ms) = NULL;
+__thread unsigned long hostSpiByteNs = 64000; // bus time of one SPI byte, DIV128 of a 16 MHz Arduino until setClockDivider
+__thread unsigned long hostSpiNs = 0; // bus time not yet added to hostClock
+
+int hostSerialFd = -1;
+
+SPIClass SPI;
+HardwareSerial Serial;
+
+void init(int argc, char *argv[])
+{
+	(void)argc;
+	(void)argv;
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+	(void)pin;
+	(void)mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+	if(pin == HOST_CS_PIN)
+		mfrc522_host_select(val);
+	if(pin < HOST_PINS)
+		hostPins[pin] = val;
+}
+
+int digitalRead(uint8_t pin)
+{
+	return pin < HOST_PINS ? hostPins[pin] : LOW;
+}
+
+void host_pin_set(uint8_t pin, int val)
+{
+	if(pin < HOST_PINS)
+		hostPins[pin] = val;
+}
+
+void delay(unsigned long ms)
+{
+	if(hostDelayHook != NULL)
+		hostDelayHook(ms);
+	hostClock += ms * 1000;
+}
+
+void delayMicroseconds(unsigned int us)
+{
+	hostClock += us;
+}
+
+unsigned long millis(void)
+{
+	return hostClock / 1000;
+}
+
+unsigned long micros(void)
+{
+	return hostClock;
+}
+
+void host_clock_set(unsigned long us)
+{
+	hostClock = us;
+}
+
+void host_delay_hook(void (*hook)(unsigned long ms))
+{
+	hostDelayHook = hook;
+}
+
+void SPIClass::begin(void)
+{
+}
+
+void SPIClass::end(void)
+{
+}
+
+uint8_t SPIClass::transfer(uint8_t data)
+{
+	hostSpiNs += hostSpiByteNs; // the virtual clock runs on with the bus, a boot time on the host includes the calibration
+	hostClock += hostSpiNs / 1000;
+	hostSpiNs %= 1000;
+	return mfrc522_host_transfer(data);
+}
+
+void SPIClass::setClockDivider(uint8_t divider)
+{
+	static const uint8_t dividers[] = {4, 16, 64, 128, 2, 8, 32}; // by SPI_CLOCK_DIV* value
+
+	if(divider < sizeof(dividers))
+		hostSpiByteNs = 8 * dividers[divider] * 1000UL / 16; // 8 bits at 16 MHz / divider
+}
+
+void host_serial_open(const char *path)
+{
+	struct termios tio;
+
+	hostSerialFd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if(hostSerialFd < 0)
+	{
+		perror(path);
+		return;
+	}
+	if(tcgetattr(hostSerialFd, &tio) == 0)
+	{
+		cfmakeraw(&tio);
+		tcsetattr(hostSerialFd, TCSANOW, &tio);
+	}
+}
+
+void HardwareSerial::begin(unsigned long baud)
+{
+	(void)baud;
+}
+
+/* Waits up to 1 ms for data, so polling loops do not spin */
+int HardwareSerial::available(void)
+{
+	struct pollfd pfd;
+
+	if(hostSerialFd < 0)
+		return 0;
+	pfd.fd = hostSerialFd;
+	pfd.events = POLLIN;
+	return poll(&pfd, 1, 1) > 0 && (pfd.revents & POLLIN) ? 1 : 0;
+}
+
+int HardwareSerial::read(void)
+{
+	uint8_t c;
+
+	if(hostSerialFd < 0 || ::read(hostSerialFd, &c, 1) != 1)
+		return -1;
+	return c;
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+	return write(&c, 1);
+}
+
+size_t HardwareSerial::write(const uint8_t *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while(hostSerialFd >= 0 && done < len)
+	{
+		n = ::write(hostSerialFd, buf + done, len - done);
+		if(n > 0)
+			done += n;
+		else if(n < 0 && errno == EAGAIN)
+			usleep(1000); // the pty buffer is full
+		else
+			break; // the gateway side is closed
+	}
+	return len;
+}
@@ -0,0 +1,41 @@
+#!/bin/bash
+# Boot the host build three times and check the 1 s boot target (make board=host and make
+# decode first). The emulated bus runs at the SPI clock of a 16 MHz Arduino, so the time from
+# setup() to the first card poll (EV_BOOT_READY) includes the SPI clock calibration. The first
+# boot sweeps the clock, the second keeps the saved step, and the third finds the saved step
+# older than SPI_CLOCK_MAX_AGE_S and sweeps again. The fourth has its first two reader inits
+# fail the register read-back, and boot_reader has to start over within the same target.
+
+source "$(dirname "$0")/test_lib.sh"
+
+# boot <name> <saved> <attempts> [options]: one boot, <saved> is 1 if it has to keep the saved
+# clock step, <attempts> the reader bring-ups it has to take
+boot()
+{
+	local out ms tries
+	rm -f events.bin
+	out=$("$repo"/SUC-host.elf --server 127.0.0.1:1 --loops 1 "${@:4}")
+	ms=$("$repo"/evlog_decode events.bin | sed -n 's/.*EV_BOOT_READY *first card poll \([0-9]*\) ms.*/\1/p')
+	tries=$("$repo"/evlog_decode events.bin | sed -n 's/.*EV_BOOT_READY.*reader attempts \([0-9]*\).*/\1/p')
+	echo "$1 boot: first card poll after ${ms:-?} ms, reader attempts ${tries:-?}"
+	if [ "$tries" != "$3" ]; then
+		echo "$1 boot: expected $3 reader attempts"
+		failed=1
+	fi
+	if [ -z "$ms" ] || [ "$ms" -ge 1000 ]; then
+		echo "$1 boot missed the 1 s target"
+		failed=1
+	fi
+	if [ "$(echo "$out" | grep -q 'SPI clock step .*(saved)' && echo 1 || echo 0)" -ne "$2" ]; then
+		echo "$1 boot: expected saved clock step $2, got '$(echo "$out" | grep 'SPI clock step')'"
+		failed=1
+	fi
+}
+
+boot Cold 0 1
+boot Warm 1 1
+touch -d "8 days ago" spiClock.txt
+boot Aged 0 1
+boot Faulty 1 3 --init-faults 2
+
+finish Boot
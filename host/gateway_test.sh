@@ -0,0 +1,48 @@
+#!/bin/bash
+# Run the gateway against two simulated nodes on pseudo terminals and the stand-in server,
+# which answers each request after 500 ms (make board=host and make standin first).
+# Every node has to get a real user status through the uplink and its borrow or return
+# record has to reach the server.
+
+source "$(dirname "$0")/test_lib.sh"
+port=3998
+log=$work/gateway.log
+start_standin $port -l 500
+"$repo"/SUC-host.elf --server 127.0.0.1:$port --gateway-pty 2 > "$log" &
+gateway=$!
+for i in $(seq 50); do
+	[ "$(grep -c '^Node port' "$log")" -eq 2 ] && break
+	sleep 0.1
+done
+ports=($(sed -n 's/^Node port //p' "$log"))
+if [ ${#ports[@]} -ne 2 ]; then
+	echo "Gateway did not open its node ports"
+	kill $gateway
+	failed=1
+	finish
+fi
+
+"$repo"/SUC-node.elf --serial "${ports[0]}" --station 21 --user --loops 5 > /dev/null &
+node1=$!
+"$repo"/SUC-node.elf --serial "${ports[1]}" --station 22 --user --loops 5 > /dev/null &
+node2=$!
+wait $node1 $node2
+sleep 1.5
+
+for station in 21 22; do
+	status=$(sed -n "s/^Station $station: user status of [0-9-]* is //p" "$log" | head -1)
+	if [ "$status" != 0 ] && [ "$status" != 1 ]; then
+		echo "Station $station got no user status from the server (${status:-no answer})"
+		failed=1
+	fi
+	stats=$(curl -s "http://127.0.0.1:$port/stats/$station" 2> /dev/null)
+	if [ "$stats" != "1 0" ]; then
+		echo "Station $station: server holds records/duplicates '${stats}', expected '1 0'"
+		failed=1
+	fi
+done
+kill $gateway
+wait $gateway 2> /dev/null
+
+cat "$log"
+finish Gateway
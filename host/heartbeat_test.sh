@@ -0,0 +1,63 @@
+#!/bin/bash
+# Run the gateway with one simulated node against the stand-in server (make board=host and
+# make standin first). The state the server puts together from the forwarded heartbeats has
+# to match the node: slot 1 emptied by the borrow, slot 2 still empty, one unlock and no
+# queued or dropped records. The server is then restarted, so the next partial heartbeat gets
+# a 409 and the gateway has to send the complete state again.
+
+source "$(dirname "$0")/test_lib.sh"
+port=3997
+log=$work/gateway.log
+
+# check <round>: compare the merged heartbeat state of station 31 with the node
+check()
+{
+	local state fields field
+	state=$(curl -s "http://127.0.0.1:$port/stations/31/heartbeat" 2> /dev/null)
+	fields=$(echo "$state" | tr '&' '\n' | grep -vc '^seq=')
+	if [ "$fields" -ne 16 ]; then
+		echo "Round $1: server holds $fields heartbeat fields, expected 16 ('$state')"
+		failed=1
+	fi
+	for field in slot1=0 slot2=0 unlocks=1 queued=0 dropped=0; do
+		if ! echo "&$state&" | grep -q "&$field&"; then
+			echo "Round $1: expected $field in '$state'"
+			failed=1
+		fi
+	done
+}
+
+start_standin $port
+"$repo"/SUC-host.elf --server 127.0.0.1:$port --gateway-pty 1 > "$log" &
+gateway=$!
+for i in $(seq 50); do
+	grep -q '^Node port' "$log" && break
+	sleep 0.1
+done
+node=$(sed -n 's/^Node port //p' "$log")
+if [ -z "$node" ]; then
+	echo "Gateway did not open its node port"
+	kill $gateway
+	failed=1
+	finish
+fi
+
+"$repo"/SUC-node.elf --serial "$node" --station 31 --user --loops 5 > /dev/null
+sleep 1.5
+check 1
+
+stop_standin
+start_standin $port
+"$repo"/SUC-node.elf --serial "$node" --station 31 --user --loops 5 > /dev/null
+sleep 1.5
+check 2
+if ! grep -q '^Station 31: the server holds no heartbeat state' "$log"; then
+	echo "Round 2: the restarted server did not ask for the complete state"
+	failed=1
+fi
+
+kill $gateway
+wait $gateway 2> /dev/null
+
+cat "$log"
+finish Heartbeat
@@ -0,0 +1,11 @@
+#!/bin/bash
+# Run 200 simulated stations against the stand-in server with injected latency,
+# failures and dropped answers (make board=host and make standin first).
+# Every record the server lacks has to be a failed upload, repeated uploads are reported.
+
+source "$(dirname "$0")/test_lib.sh"
+port=3999
+start_standin $port -l 2 -j 8 -f 2 -d 1
+
+"$repo"/SUC-loadgen.elf --server 127.0.0.1:$port --station 1000 --stations 200 --duration 5 --interval 500 || failed=1
+finish Load
@@ -0,0 +1,643 @@
+/*
+ * Emulated MFRC522 with one MIFARE Classic 1K or Ultralight/NTAG card in the field
+ *
+ * Commands complete as soon as they are started, so every wait in the driver
+ * sees its interrupt bit on the first poll. Crypto1 is not modelled: a card
+ * accepts the plain frames once the sector key matched.
+ */
+
+#include <string.h>
+#include "mfrc522_host.h"
+
+// Registers with behaviour, the rest is plain storage
+#define CommandReg            0x01
+#define CommIrqReg            0x04
+#define DivIrqReg             0x05
+#define ErrorReg              0x06
+#define Status2Reg            0x08
+#define FIFODataReg           0x09
+#define FIFOLevelReg          0x0A
+#define ControlReg            0x0C
+#define BitFramingReg         0x0D
+#define CRCResultRegM         0x21
+#define CRCResultRegL         0x22
+
+#define PCD_IDLE              0x00
+#define PCD_AUTHENT           0x0E
+#define PCD_TRANSCEIVE        0x0C
+#define PCD_RESETPHASE        0x0F
+#define PCD_CALCCRC           0x03
+
+#define FIFO_SIZE             64
+#define UL_PAGES              45 // NTAG213
+
+enum { CARD_IDLE, CARD_READY, CARD_READY2, CARD_ACTIVE, CARD_HALT }; // CARD_READY2: cascade level 1 selected, level 2 follows
+
+typedef struct
+{
+	uint8_t regs[64];
+	uint8_t fifo[FIFO_SIZE];
+	int fifoLen;
+	int selected; // chip select is low
+	int haveAddr; // the address byte of this transfer was received
+	int resetReads; // CommandReg reads left with PowerDown set after a soft reset, the oscillator start-up
+	int lostWrites; // TModeReg writes left that the reader drops, host_reader_lose_writes
+	uint8_t addr;
+	int read;
+	HostBusStats stats;
+
+	int present;
+	int state;
+	int woken; // woken from HALT by WUPA (READY*, ACTIVE*), an error sends the card back to HALT instead of IDLE
+	int type; // HOST_CARD_*
+	uint8_t uid[7];
+	int uidLen;
+	uint8_t blocks[64][16]; // Ultralight: the pages follow each other from blocks[0]
+	int authSector; // -1: not authenticated
+	int pendingWrite; // block waiting for the second WRITE frame, -1: none
+	int pendingValue; // block waiting for the INCREMENT/DECREMENT/RESTORE operand, -1: none
+	uint8_t pendingCmd;
+	int32_t transferBuffer; // result of the last value operation
+	int haveTransfer;
+} HostReader;
+
+__thread HostReader hostReader; // one reader per station thread in the load generator
+__thread int hostReaderReady = 0;
+
+void reader_reset(void)
+{
+	HostReader *r = &hostReader;
+
+	memset(r->regs, 0, sizeof(r->regs));
+	r->regs[CommandReg] = 0x20;
+	r->regs[0x02] = 0x80; // CommIEnReg
+	r->regs[CommIrqReg] = 0x14;
+	r->regs[0x07] = 0x21; // Status1Reg
+	r->regs[0x0B] = 0x08; // WaterLevelReg
+	r->regs[ControlReg] = 0x10;
+	r->regs[0x0E] = 0xA0; // CollReg
+	r->regs[0x11] = 0x3F; // ModeReg
+	r->regs[0x14] = 0x80; // TxControlReg
+	r->regs[0x16] = 0x10; // TxSelReg
+	r->regs[0x17] = 0x84; // RxSelReg
+	r->regs[0x18] = 0x84; // RxThresholdReg
+	r->regs[0x19] = 0x4D; // DemodReg
+	r->regs[0x24] = 0x26; // ModWidthReg
+	r->regs[0x26] = 0x48; // RFCfgReg
+	r->regs[0x27] = 0x88; // GsNReg
+	r->regs[0x28] = 0x20; // CWGsPReg
+	r->regs[0x29] = 0x20; // ModGsPReg
+	r->regs[0x37] = 0x92; // VersionReg: MFRC522 v2.0
+	r->fifoLen = 0;
+}
+
+/* Factory content of the card memory */
+void card_format(void)
+{
+	HostReader *r = &hostReader;
+	static const uint8_t trailer[16] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x07, 0x80, 0x69, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+	uint8_t *page = r->blocks[0];
+	int i;
+
+	memset(r->blocks, 0, sizeof(r->blocks));
+	if(r->type != HOST_CARD_ULTRALIGHT)
+	{
+		for(i = 3; i < 64; i += 4)
+			memcpy(r->blocks[i], trailer, 16);
+		return;
+	}
+	// pages 0-2: serial number with check bytes, lock bytes; page 3: capability container
+	page[0] = r->uid[0];
+	page[1] = r->uid[1];
+	page[2] = r->uid[2];
+	page[3] = 0x88 ^ r->uid[0] ^ r->uid[1] ^ r->uid[2];
+	memcpy(page + 4, r->uid + 3, 4);
+	page[8] = r->uid[3] ^ r->uid[4] ^ r->uid[5] ^ r->uid[6];
+	page[12] = 0xE1;
+	page[13] = 0x10;
+	page[14] = 0x12;
+	page[16] = 0x03; // page 4: empty NDEF message and the terminator TLV
+	page[18] = 0xFE;
+}
+
+void reader_init(void)
+{
+	HostReader *r = &hostReader;
+	static const uint8_t uid[4] = {0x12, 0x34, 0x56, 0x78};
+
+	memset(r, 0, sizeof(*r));
+	reader_reset();
+	r->present = 1;
+	r->state = CARD_IDLE;
+	r->type = HOST_CARD_CLASSIC_1K;
+	memcpy(r->uid, uid, 4);
+	r->uidLen = 4;
+	card_format();
+	r->authSector = -1;
+	r->pendingWrite = -1;
+	r->pendingValue = -1;
+	hostReaderReady = 1;
+}
+
+HostReader *reader(void)
+{
+	if(!hostReaderReady)
+		reader_init();
+	return &hostReader;
+}
+
+/* ISO/IEC 14443-3 CRC_A */
+void crc_a(const uint8_t *data, int len, uint8_t *out)
+{
+	uint16_t crc = 0x6363;
+	uint8_t b;
+	int i;
+
+	for(i = 0; i < len; i++)
+	{
+		b = data[i] ^ (crc & 0xFF);
+		b ^= b << 4;
+		crc = (crc >> 8) ^ ((uint16_t)b << 8) ^ ((uint16_t)b << 3) ^ (b >> 4);
+	}
+	out[0] = crc & 0xFF;
+	out[1] = crc >> 8;
+}
+
+int crc_ok(const uint8_t *frame, int len)
+{
+	uint8_t crc[2];
+
+	if(len < 3)
+		return 0;
+	crc_a(frame, len - 2, crc);
+	return crc[0] == frame[len - 2] && crc[1] == frame[len - 1];
+}
+
+void fifo_push(const uint8_t *data, int len)
+{
+	HostReader *r = reader();
+
+	while(len-- > 0 && r->fifoLen < FIFO_SIZE)
+		r->fifo[r->fifoLen++] = *data++;
+}
+
+/* Answer with bytes plus CRC, or with a 4-bit ACK/NAK when bits == 4 */
+void card_answer(const uint8_t *data, int len, int withCrc, int bits)
+{
+	HostReader *r = reader();
+	uint8_t crc[2];
+
+	fifo_push(data, len);
+	if(withCrc)
+	{
+		crc_a(data, len, crc);
+		fifo_push(crc, 2);
+	}
+	r->regs[ControlReg] = (r->regs[ControlReg] & ~0x07) | (bits & 0x07);
+	r->regs[CommIrqReg] |= 0x70; // TxIRq RxIRq IdleIRq
+}
+
+void card_silent(void)
+{
+	HostReader *r = reader();
+
+	r->regs[ControlReg] &= ~0x07;
+	r->regs[CommIrqReg] |= 0x41; // TxIRq TimerIRq
+}
+
+/* Value block check, see the layout above MFRC522_ValueFormat in main.c */
+int value_get(const uint8_t *block, int32_t *value)
+{
+	int i;
+
+	for(i = 0; i < 4; i++)
+	{
+		if(block[i] != block[i + 8] || block[i] != (uint8_t)~block[i + 4])
+			return 0;
+	}
+	if(block[12] != block[14] || block[13] != block[15] || block[12] != (uint8_t)~block[13])
+		return 0;
+	*value = (int32_t)(block[0] | (block[1] << 8) | (block[2] << 16) | ((uint32_t)block[3] << 24));
+	return 1;
+}
+
+void value_set(uint8_t *block, int32_t value, uint8_t addr)
+{
+	int i;
+
+	for(i = 0; i < 4; i++)
+	{
+		block[i] = (uint32_t)value >> (8 * i);
+		block[i + 4] = ~block[i];
+		block[i + 8] = block[i];
+	}
+	block[12] = addr;
+	block[13] = ~addr;
+	block[14] = addr;
+	block[15] = ~addr;
+}
+
+void card_transceive(void)
+{
+	HostReader *r = reader();
+	uint8_t frame[FIFO_SIZE];
+	uint8_t buf[5];
+	int len = r->fifoLen;
+	int lastBits = r->regs[BitFramingReg] & 0x07;
+	int block, ultralight = r->type == HOST_CARD_ULTRALIGHT;
+	static const uint8_t ack = 0x0A;
+	static const uint8_t nak = 0x04; // invalid operation
+	int32_t value, operand;
+	uint8_t pages[16];
+	int i;
+
+	memcpy(frame, r->fifo, len);
+	r->fifoLen = 0;
+
+	if(!r->present || len == 0)
+	{
+		card_silent();
+		return;
+	}
+	if(lastBits == 7 && len == 1) // REQA / WUPA
+	{
+		if((frame[0] == 0x26 && r->state == CARD_IDLE) || (frame[0] == 0x52 && (r->state == CARD_IDLE || r->state == CARD_HALT)))
+		{
+			buf[0] = r->uidLen == 7 ? 0x44 : 0x04; // ATQA, the UID size alone
+			buf[1] = 0x00;
+			r->woken = r->state == CARD_HALT;
+			r->state = CARD_READY;
+			card_answer(buf, 2, 0, 0);
+		}
+		else
+		{
+			if(r->state != CARD_IDLE && r->state != CARD_HALT) // unexpected in READY or ACTIVE
+				r->state = r->woken ? CARD_HALT : CARD_IDLE;
+			card_silent();
+		}
+		return;
+	}
+	if(r->pendingWrite >= 0) // second WRITE frame: 16 bytes + CRC
+	{
+		block = r->pendingWrite;
+		r->pendingWrite = -1;
+		if(len == 18 && crc_ok(frame, len))
+		{
+			memcpy(r->blocks[block], frame, 16);
+			card_answer(&ack, 1, 0, 4);
+		}
+		else
+			card_silent();
+		return;
+	}
+	if(r->pendingValue >= 0) // second value frame: 4-byte operand + CRC, only a failure is answered
+	{
+		block = r->pendingValue;
+		r->pendingValue = -1;
+		if(len != 6 || !crc_ok(frame, len))
+			card_silent();
+		else if(!value_get(r->blocks[block], &value))
+			card_answer(&nak, 1, 0, 4);
+		else
+		{
+			operand = (int32_t)(frame[0] | (frame[1] << 8) | (frame[2] << 16) | ((uint32_t)frame[3] << 24));
+			if(r->pendingCmd == 0xC1)
+				value += operand;
+			else if(r->pendingCmd == 0xC0)
+				value -= operand;
+			r->transferBuffer = value;
+			r->haveTransfer = 1;
+			card_silent();
+		}
+		return;
+	}
+	// serial number bytes of cascade level 1 and 2, a double size UID starts with the cascade tag
+	if(r->uidLen == 4)
+		memcpy(buf, r->uid, 4);
+	else if(r->state == CARD_READY2)
+		memcpy(buf, r->uid + 3, 4);
+	else
+	{
+		buf[0] = 0x88;
+		memcpy(buf + 1, r->uid, 3);
+	}
+	buf[4] = buf[0] ^ buf[1] ^ buf[2] ^ buf[3];
+	if(len == 2 && frame[1] == 0x20 && ((frame[0] == 0x93 && r->state == CARD_READY) || (frame[0] == 0x95 && r->state == CARD_READY2))) // anticollision
+	{
+		card_answer(buf, 5, 0, 0);
+		return;
+	}
+	if(len == 9 && frame[1] == 0x70 && crc_ok(frame, len) && memcmp(frame + 2, buf, 4) == 0
+		&& ((frame[0] == 0x93 && r->state == CARD_READY) || (frame[0] == 0x95 && r->state == CARD_READY2)))
+	{
+		if(r->uidLen == 7 && r->state == CARD_READY)
+		{
+			buf[0] = 0x04; // SAK: UID not complete
+			r->state = CARD_READY2;
+		}
+		else
+		{
+			buf[0] = ultralight ? 0x00 : 0x08; // SAK
+			r->state = CARD_ACTIVE;
+		}
+		r->authSector = -1;
+		r->haveTransfer = 0;
+		card_answer(buf, 1, 1, 0);
+		return;
+	}
+	if(r->state != CARD_ACTIVE || !crc_ok(frame, len))
+	{
+		r->state = (r->state == CARD_HALT || r->woken) ? CARD_HALT : CARD_IDLE;
+		card_silent();
+		return;
+	}
+
+	if(ultralight)
+	{
+		block = frame[1];
+		if(frame[0] == 0x30 && len == 4 && block < UL_PAGES) // READ: 4 pages, no authentication, wraps around
+		{
+			for(i = 0; i < 4; i++)
+				memcpy(pages + 4 * i, r->blocks[0] + ((block + i) % UL_PAGES) * 4, 4);
+			card_answer(pages, 16, 1, 0);
+		}
+		else if(frame[0] == 0xA2 && len == 8 && block >= 4 && block < UL_PAGES) // WRITE: one page
+		{
+			memcpy(r->blocks[0] + block * 4, frame + 2, 4);
+			card_answer(&ack, 1, 0, 4);
+		}
+		else if(frame[0] == 0x50) // HALT
+		{
+			r->state = CARD_HALT;
+			card_silent();
+		}
+		else
+			card_answer(&nak, 1, 0, 4);
+		return;
+	}
+
+	block = frame[1] & 0x3F;
+	switch(frame[0])
+	{
+		case 0x50: // HALT
+			r->state = CARD_HALT;
+			r->authSector = -1;
+			r->haveTransfer = 0;
+			r->regs[Status2Reg] &= ~0x08;
+			card_silent();
+			break;
+		case 0x30: // READ
+			if(r->authSector == block / 4)
+				card_answer(r->blocks[block], 16, 1, 0);
+			else
+				card_silent();
+			break;
+		case 0xA0: // WRITE, the data follows in a second frame
+			if(r->authSector == block / 4)
+			{
+				r->pendingWrite = block;
+				card_answer(&ack, 1, 0, 4);
+			}
+			else
+				card_silent();
+			break;
+		case 0xC0: // DECREMENT
+		case 0xC1: // INCREMENT
+		case 0xC2: // RESTORE, the operand follows in a second frame
+			if(r->authSector == block / 4 && block % 4 != 3)
+			{
+				r->pendingValue = block;
+				r->pendingCmd = frame[0];
+				card_answer(&ack, 1, 0, 4);
+			}
+			else
+				card_answer(&nak, 1, 0, 4);
+			break;
+		case 0xB0: // TRANSFER
+			if(r->authSector == block / 4 && block % 4 != 3 && r->haveTransfer)
+			{
+				value_set(r->blocks[block], r->transferBuffer, block);
+				r->haveTransfer = 0;
+				card_answer(&ack, 1, 0, 4);
+			}
+			else
+				card_answer(&nak, 1, 0, 4);
+			break;
+		default:
+			card_silent();
+			break;
+	}
+}
+
+void card_authent(void)
+{
+	HostReader *r = reader();
+	int block;
+	uint8_t *key;
+
+	r->regs[CommIrqReg] |= 0x10; // IdleIRq
+	if(r->fifoLen < 12 || r->state != CARD_ACTIVE || !r->present)
+		return;
+	block = r->fifo[1] & 0x3F;
+	key = r->blocks[(block / 4) * 4 + 3] + (r->fifo[0] == 0x60 ? 0 : 10);
+	r->fifoLen = 0;
+	if(memcmp(r->fifo + 2, key, 6) == 0 && memcmp(r->fifo + 8, r->uid + r->uidLen - 4, 4) == 0) // a 7-byte UID: its last 4 bytes
+	{
+		r->authSector = block / 4;
+		r->regs[Status2Reg] |= 0x08; // MFCrypto1On
+	}
+	else
+	{
+		r->regs[ErrorReg] |= 0x08; // ProtocolErr
+		r->state = r->woken ? CARD_HALT : CARD_IDLE;
+	}
+}
+
+void reader_command(uint8_t cmd)
+{
+	HostReader *r = reader();
+	uint8_t crc[2];
+
+	r->regs[CommandReg] = cmd;
+	switch(cmd & 0x0F)
+	{
+		case PCD_RESETPHASE:
+			reader_reset();
+			r->resetReads = 2;
+			break;
+		case PCD_CALCCRC:
+			crc_a(r->fifo, r->fifoLen, crc);
+			r->regs[CRCResultRegL] = crc[0];
+			r->regs[CRCResultRegM] = crc[1];
+			r->fifoLen = 0;
+			r->regs[DivIrqReg] |= 0x04; // CRCIRq
+			r->regs[CommandReg] = PCD_IDLE;
+			break;
+		case PCD_AUTHENT:
+			r->regs[ErrorReg] = 0;
+			card_authent();
+			r->regs[CommandReg] = PCD_IDLE;
+			break;
+		default:
+			break;
+	}
+}
+
+void reg_write(uint8_t addr, uint8_t val)
+{
+	HostReader *r = reader();
+
+	switch(addr)
+	{
+		case CommandReg:
+			reader_command(val);
+			break;
+		case CommIrqReg:
+		case DivIrqReg:
+			if(val & 0x80) // Set1
+				r->regs[addr] |= val & 0x7F;
+			else
+				r->regs[addr] &= ~val;
+			break;
+		case FIFODataReg:
+			fifo_push(&val, 1);
+			break;
+		case FIFOLevelReg:
+			if(val & 0x80) // FlushBuffer
+				r->fifoLen = 0;
+			break;
+		case BitFramingReg:
+			r->regs[addr] = val & 0x7F;
+			if((val & 0x80) && (r->regs[CommandReg] & 0x0F) == PCD_TRANSCEIVE) // StartSend
+			{
+				r->regs[ErrorReg] = 0;
+				card_transceive();
+			}
+			break;
+		case 0x37: // VersionReg is read only
+			break;
+		case 0x2A: // TModeReg, outside the calibration pattern test, a dropped write shows only at init
+			if(r->lostWrites > 0)
+			{
+				r->lostWrites--;
+				break;
+			}
+			r->regs[addr] = val;
+			break;
+		default:
+			r->regs[addr] = val;
+			break;
+	}
+}
+
+uint8_t reg_read(uint8_t addr)
+{
+	HostReader *r = reader();
+	uint8_t val;
+
+	switch(addr)
+	{
+		case CommIrqReg:
+		case DivIrqReg:
+			r->stats.polls++;
+			return r->regs[addr];
+		case FIFODataReg:
+			if(r->fifoLen == 0)
+				return 0;
+			val = r->fifo[0];
+			memmove(r->fifo, r->fifo + 1, --r->fifoLen);
+			return val;
+		case FIFOLevelReg:
+			return r->fifoLen;
+		case CommandReg:
+			if(r->resetReads > 0)
+			{
+				r->resetReads--;
+				return r->regs[addr] | 0x10; // PowerDown
+			}
+			return r->regs[addr];
+		default:
+			return r->regs[addr];
+	}
+}
+
+/* Chip select from digitalWrite(HOST_CS_PIN), a new transfer starts on the falling edge */
+void mfrc522_host_select(int level)
+{
+	HostReader *r = reader();
+
+	r->stats.chipSelects++;
+	r->selected = (level == 0);
+	r->haveAddr = 0;
+}
+
+/* One SPI byte: the first byte after chip select is the address (1XXXXXX0 read, 0XXXXXX0 write) */
+uint8_t mfrc522_host_transfer(uint8_t data)
+{
+	HostReader *r = reader();
+
+	r->stats.transfers++;
+	if(!r->selected)
+		return 0xFF;
+	if(!r->haveAddr)
+	{
+		r->haveAddr = 1;
+		r->addr = (data >> 1) & 0x3F;
+		r->read = data & 0x80;
+		return 0;
+	}
+	if(r->read)
+		return reg_read(r->addr);
+	reg_write(r->addr, data);
+	return 0;
+}
+
+void host_reader_lose_writes(int count)
+{
+	reader()->lostWrites = count;
+}
+
+void host_card_present(int present)
+{
+	HostReader *r = reader();
+
+	r->present = present;
+	if(!present)
+	{
+		r->state = CARD_IDLE;
+		r->woken = 0;
+		r->authSector = -1;
+	}
+}
+
+void host_card_uid(const uint8_t uid[4])
+{
+	memcpy(reader()->uid, uid, 4);
+}
+
+void host_card_type(int type)
+{
+	HostReader *r = reader();
+	static const uint8_t uid[7] = {0x04, 0x2F, 0x61, 0x8A, 0x3C, 0x52, 0x80}; // NXP manufacturer byte first
+
+	r->type = type;
+	r->state = CARD_IDLE;
+	r->woken = 0;
+	r->authSector = -1;
+	if(type != HOST_CARD_CLASSIC_1K)
+	{
+		memcpy(r->uid, uid, 7);
+		r->uidLen = 7;
+	}
+	else
+	{
+		memcpy(r->uid, uid + 3, 4);
+		r->uidLen = 4;
+	}
+	card_format();
+}
+
+void host_bus_stats(HostBusStats *stats)
+{
+	*stats = reader()->stats;
+}
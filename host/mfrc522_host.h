@@ -0,0 +1,32 @@
+/*
+ * Emulated MFRC522 with one MIFARE card in the field, attached to the host SPI bus
+ */
+
+#ifndef MFRC522_HOST_H
+#define MFRC522_HOST_H
+
+#include <stdint.h>
+
+#define HOST_CS_PIN 10 // chipSelectPin in main.c
+
+enum { HOST_CARD_CLASSIC_1K, HOST_CARD_ULTRALIGHT, HOST_CARD_CLASSIC_1K_7 }; // _7: Classic 1K with a 7-byte UID
+
+// Bus traffic seen by the emulator
+typedef struct
+{
+	unsigned long transfers; // SPI bytes
+	unsigned long chipSelects; // chip select toggles
+	unsigned long polls; // CommIrqReg and DivIrqReg reads
+} HostBusStats;
+
+void mfrc522_host_select(int level);
+uint8_t mfrc522_host_transfer(uint8_t data);
+
+/* Test controls */
+void host_card_present(int present);
+void host_card_uid(const uint8_t uid[4]);
+void host_card_type(int type); // HOST_CARD_*, the memory is reset to its factory content
+void host_bus_stats(HostBusStats *stats);
+void host_reader_lose_writes(int count); // the next count TModeReg writes are dropped, MFRC522_Init has to fail
+
+#endif
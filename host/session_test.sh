@@ -0,0 +1,24 @@
+#!/bin/bash
+# Keep one card on the emulated reader for 20 card polls against the stand-in server
+# (make board=host, make standin and make decode first). The card has to be served once:
+# one user status query, one borrow record, and while it stays on the reader one EV_CARD_HELD
+# without a new EV_CARD_FOUND at every poll.
+
+source "$(dirname "$0")/test_lib.sh"
+port=3996
+
+start_standin $port
+"$repo"/SUC-host.elf --server 127.0.0.1:$port --user --loops 20 > /dev/null
+stop_standin
+
+"$repo"/evlog_decode events.bin > events.txt
+for event in EV_CARD_FOUND EV_STATUS_QUERY EV_RECORD_UPLOAD EV_CARD_HELD; do
+	count=$(grep -c " $event " events.txt)
+	if [ "$count" -ne 1 ]; then
+		echo "$event logged $count times, expected once"
+		failed=1
+	fi
+done
+
+cat events.txt
+finish Session
@@ -0,0 +1,42 @@
+# Fixture shared by the host test scripts, sourced by them (make board=host first).
+# The programs run in a scratch directory, so no event log or saved clock step of an earlier
+# run is picked up. Sets repo, work and failed=0.
+
+repo=$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd) || exit 1
+work=$(mktemp -d) || exit 1
+cd "$work" || exit 1
+failed=0
+server=
+
+# start_standin <port> [options]: start the stand-in server and wait until it accepts connections
+start_standin()
+{
+	local port=$1 i
+	"$repo"/standin -p "$port" "${@:2}" > /dev/null &
+	server=$!
+	for i in $(seq 50); do
+		(exec 3<> "/dev/tcp/127.0.0.1/$port") 2> /dev/null && return 0
+		sleep 0.1
+	done
+	echo "standin did not accept connections on port $port"
+	failed=1
+	finish
+}
+
+# stop_standin: stop the stand-in server started by start_standin
+stop_standin()
+{
+	[ -n "$server" ] || return 0
+	kill -INT $server 2> /dev/null
+	wait $server 2> /dev/null
+	server=
+}
+
+# finish [name]: stop the stand-in server, remove the scratch directory and exit with the result
+finish()
+{
+	stop_standin
+	cd / && rm -rf "$work"
+	[ $failed -eq 0 ] && [ -n "$1" ] && echo "$1 test passed"
+	exit $failed
+}
@@ -14,10 +14,64 @@
 #include <SPI.h> // the sensor communicates using SPI
 #include <stdlib.h>
 #include <string.h>
+#ifdef GALILEO
+#include "evlog.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <termios.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <pthread.h>
+#endif
+#ifdef HOST
+#include "mfrc522_host.h"
+#endif
+
+// The AVR boards run as sensor nodes behind a gateway, -DNODE builds a node for a Linux host
+#if !defined(GALILEO) && !defined(NODE)
+#define NODE
+#endif
+
+// State of one station, thread-local when the load generator (-DLOADGEN) runs many stations in one process
+#ifdef LOADGEN
+#define STATION_LOCAL __thread
+#else
+#define STATION_LOCAL
+#endif
 
 #define	uchar unsigned char // 8 bits
 #define	uint  unsigned int // 16 bits
 
+// Constant tables and console strings stay in flash on the AVR boards (2 KB SRAM)
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#define PUTS(s) puts_P(PSTR(s))
+#define PRINTF(fmt, ...) printf_P(PSTR(fmt), ##__VA_ARGS__)
+#else
+#ifndef PROGMEM
+#define PROGMEM
+#endif
+#ifndef PSTR
+#define PSTR(s) (s)
+#endif
+#ifndef pgm_read_byte
+#define pgm_read_byte(p) (*(const uchar *)(p))
+#endif
+#ifndef memcpy_P
+#define memcpy_P memcpy
+#endif
+#define PUTS(s) puts(s)
+#define PRINTF printf
+#endif
+
 #define MAX_LEN 16 // for S50: 1 KB, organized in 16 sectors with 4 blocks of 16 bytes each (one block consists of 16 byte)
 
 // The MFRC522 command word
@@ -33,13 +87,16 @@
 #define PICC_REQIDL           0x26               // look for antenna region does not enter hibernation
 #define PICC_REQALL           0x52               // look for the antenna all the cards in the region
 #define PICC_ANTICOLL         0x93               // anti-collision
+#define PICC_ANTICOLL2        0x95               // anti-collision, cascade level 2 of a double size UID
+#define PICC_CASCADE_TAG      0x88               // first byte at cascade level 1 when the UID continues at level 2
 #define PICC_SElECTTAG        0x93               // election card
 #define PICC_AUTHENT1A        0x60               // verify A key
 #define PICC_AUTHENT1B        0x61               // verify B key
 #define PICC_READ             0x30               // read block
 #define PICC_WRITE            0xA0               // write block
-#define PICC_DECREMENT        0xC0               
-#define PICC_INCREMENT        0xC1               
+#define PICC_WRITE_PAGE       0xA2               // write one 4-byte page (Ultralight/NTAG)
+#define PICC_DECREMENT        0xC0               // subtract from a value block into the transfer buffer
+#define PICC_INCREMENT        0xC1               // add to a value block into the transfer buffer
 #define PICC_RESTORE          0xC2               // adjust the block data to buffer
 #define PICC_TRANSFER         0xB0               // save the buffer data
 #define PICC_HALT             0x50               // sleep
@@ -123,18 +180,377 @@
 const int chipSelectPin = 10; // SPI_SS
 const int NRSTPD = 9; // RESET
 
+// SPI clock dividers from the slowest to the fastest, the MFRC522 accepts at most 10 MHz (DIV2 = 8 MHz)
+const uchar spiDividers[] PROGMEM = {SPI_CLOCK_DIV128, SPI_CLOCK_DIV64, SPI_CLOCK_DIV32, SPI_CLOCK_DIV16, SPI_CLOCK_DIV8, SPI_CLOCK_DIV4, SPI_CLOCK_DIV2};
+#define SPI_CAL_ROUNDS        8    // pattern test repetitions at each clock step
+#define SPI_CLOCK_MARGIN      1    // back off this many steps from the fastest reliable clock
+#define SPI_CHECK_INTERVAL    64   // check the bus every 64 loops at runtime
+#define SPI_ERR_LIMIT         3    // consecutive failed checks before dropping back one step
+#define SPI_CARD_ERR_LIMIT    4    // card errors between two checks that call for the register pattern test
+#define SPI_CLOCK_FILE        "spiClock.txt" // clock step of the last calibration, tested again at boot instead of a new sweep
+#define SPI_CLOCK_MAX_AGE_S   (7 * 24 * 3600L) // a saved step older than this is swept again, the bus may allow a faster clock by now
+STATION_LOCAL uchar spiStep = 0; // index of the divider in use
+STATION_LOCAL uchar spiVersion = 0; // VersionReg read at calibration, re-read at runtime to detect bus errors
+STATION_LOCAL uchar spiErrCount = 0; // consecutive failed runtime checks
+STATION_LOCAL uint spiCheckCount = 0; // loops since the last runtime check
+STATION_LOCAL uint spiDrops = 0; // clock steps given up since boot
+STATION_LOCAL uint cardErrors = 0; // MFRC522_ToCard errors since boot
+STATION_LOCAL uint spiCardErrors = 0; // cardErrors at the last runtime check
+
+// Boot sequence: the reader is reset, calibrated and initialized again after a growing pause until it answers
+#define RESET_TIMEOUT_MS      50   // wait for PowerDown to clear after a soft reset (oscillator start-up)
+#define BOOT_RETRY_MIN_MS     10
+#define BOOT_RETRY_MAX_MS     1000
+STATION_LOCAL unsigned long bootStart = 0; // micros() at the start of setup()
+STATION_LOCAL unsigned long bootPollUs = 0; // boot to the first card poll, 0 before it
+STATION_LOCAL uint bootTries = 0; // reader bring-up attempts
+
+// MFRC522_Init register sequence, {register, value, bits MFRC522_Init reads back}, reserved bits are not checked
+const uchar initTable[][3] PROGMEM =
+{
+	// Timer: TPrescaler * TreloadVal/6.78MHz = 24ms
+	{TModeReg, 0x8D, 0xFF}, // Tauto = 1; f(Timer) = 6.78MHz/TPreScaler
+	{TPrescalerReg, 0x3E, 0xFF}, // TModeReg[3..0] + TPrescalerReg
+	{TReloadRegL, 30, 0xFF},
+	{TReloadRegH, 0, 0xFF},
+	{TxAutoReg, 0x40, 0x40}, // 100%ASK
+	{ModeReg, 0x3D, 0xAB}, // CRC初始值0x6363
+	{DivlEnReg, 0x80, 0x80}, // IRQPushPull = 1, the IRQ pin is a standard CMOS output
+	{ModWidthReg, 0x26, 0xFF}, // reset value, reg_pattern_test writes it
+};
+
+// RF front-end settings, written after initTable by MFRC522_Init
+typedef struct
+{
+	uchar rfCfg; // RFCfgReg: RxGain[6..4], 0 = 18dB ... 7 = 48dB
+	uchar rxThreshold; // RxThresholdReg: MinLevel[7..4] CollLevel[2..0]
+	uchar cwGsP; // CWGsPReg: p-driver conductance without modulation
+	uchar modGsP; // ModGsPReg: p-driver conductance during modulation
+} RFProfile;
+STATION_LOCAL RFProfile rfProfile = {0x48, 0x84, 0x20, 0x20}; // MFRC522 reset values
+#define RF_PROFILE_FILE       "rfProfile.txt"
+#define RF_TUNE_ATTEMPTS      32   // card requests per setting in tuning mode
+
 int ENA = 1, IN1 = 2, IN2 = 3; // Set Arduino pins for L298
-int total_time = 0; // Record rotation time
+STATION_LOCAL int total_time = 0; // Record rotation time
+STATION_LOCAL uint unlockCount = 0; // forward() runs since boot
 
 int green = 4; // Green LED
 
 int ubl_1 = 5, ubl_2 = 6; // umbrella digital read pin
 
-// 4-byte card serial number, 5th byte is checksum byte
-uchar serNum[5] = {0};
+int irq = 7; // MFRC522 IRQ pin, active low
+// Linux GPIO numbers of the pins above for sysfs edge events (Galileo Gen 1: IO5, IO6, IO7)
+#define UBL_1_GPIO            17
+#define UBL_2_GPIO            24
+#define IRQ_GPIO              27
+#define CARD_POLL_MS          100  // sleep between card requests while the slots do not change, the MFRC522 has no card-detect interrupt
+#define TOCARD_TIMEOUT_MS     25   // the maximum operation wait time for M1 card
+
+// Real-time mode (--rt [priority]): the card polling path runs under SCHED_FIFO with locked memory,
+// from the poll sleep to MFRC522_Halt except for the server lookup
+#define RT_PRIORITY           50   // default SCHED_FIFO priority
+#define RT_CPU                0    // CPU the reader is pinned to
+#define RT_STACK_PREFAULT     (64*1024) // stack touched once so the polling path never page faults
+#define RT_REPORT_INTERVAL    600  // card polls between jitter reports
+int rtPriority = 0; // 0: real-time mode off
+uchar rtActive = 0; // between rt_enter and rt_leave at SCHED_FIFO
+#if defined(GALILEO) && !defined(LOADGEN)
+#define RT_EVENTS             32   // events held back while the reader runs at real-time priority
+EvRecord rtEvents[RT_EVENTS]; // preallocated, rt_leave copies them to the event log
+uchar rtEventCount = 0;
+#endif
+
+// Lateness against a deadline in micro seconds
+typedef struct
+{
+	unsigned long count;
+	unsigned long sum;
+	unsigned long max; // worst lateness
+	unsigned long misses; // samples later than the deadline
+} JitterStat;
+STATION_LOCAL JitterStat pollJitter = {0}; // card poll wakeup after CARD_POLL_MS
+STATION_LOCAL JitterStat transceiveJitter = {0}; // MFRC522_ToCard against TOCARD_TIMEOUT_MS
+STATION_LOCAL unsigned long pollStart = 0;
+STATION_LOCAL JitterStat serverTime = {0}; // server (or gateway) request time against deadline 0, reset by each heartbeat
+
+// SPI trace: --spi-trace <file> records every register access, --replay <file> feeds a recording back into the driver
+#define TRACE_MAGIC           0x52545053 // "SPTR"
+#define TRACE_VERSION         1
+enum { TRACE_OFF, TRACE_CAPTURE, TRACE_REPLAY };
+enum { TR_READ, TR_WRITE, TR_PIN, TR_IRQ, TR_WAKE, TR_STATUS, TR_TIME, TR_TYPES }; // record types
+typedef struct
+{
+	uint32_t us; // micros() at the access
+	uint8_t type; // TR_*
+	uint8_t addr; // register or pin
+	int16_t val;
+} TraceRecord;
+#ifdef GALILEO
+uchar traceMode = TRACE_OFF;
+#else
+#define traceMode TRACE_OFF
+#endif
+
+#ifdef HOST
+// Bus traffic budget of each public driver operation on the emulated MFRC522, checked by --spi-budget
+typedef struct
+{
+	const char *name;
+	unsigned long transfers; // SPI bytes
+	unsigned long chipSelects; // chip select toggles
+	unsigned long polls; // CommIrqReg and DivIrqReg reads
+} BusBudget;
+const BusBudget busBudget[] =
+{
+	{"MFRC522_Request",   38, 38, 2},
+	{"MFRC522_Anticoll",  46, 46, 2},
+	{"MFRC522_SelectTag", 84, 84, 4},
+	{"MFRC522_Auth",      48, 48, 2},
+	{"MFRC522_Read",      90, 90, 4},
+	{"MFRC522_Write",     176, 176, 8},
+	{"MFRC522_ValueFormat", 176, 176, 8},
+	{"MFRC522_Decrement", 128, 128, 8},
+	{"MFRC522_Transfer",  60, 60, 4},
+	{"MFRC522_Halt",      60, 60, 4},
+	// Ultralight/NTAG213 path, the emulated card is switched over first
+	{"Request UL",        38, 38, 2},
+	{"card_select UL",    260, 260, 12},
+	{"card_ndef_layout",  90, 90, 4},
+	{"card_state_write UL", 304, 304, 16},
+};
+#endif
+
+STATION_LOCAL int ublFd[2] = {-1, -1}; // slot sensor value files, -1 falls back to polling
+STATION_LOCAL int irqFd = -1; // MFRC522 IRQ value file, -1 falls back to polling CommIrqReg
+
+#ifndef SERVER_IP
+#define SERVER_IP             "140.112.42.93"
+#endif
+#ifndef SERVER_PORT
+#define SERVER_PORT           "3000"
+#endif
+#define STATION_ID            12
+#ifdef NODE
+#define REQUEST_TIMEOUT_MS    3000 // wait for the gateway to answer a status query
+#ifndef BAUD_RATE
+#define BAUD_RATE             115200
+#endif
+#define SERVER                PSTR(SERVER_IP), PSTR(SERVER_PORT) // not used by the uplink, the gateway knows the database
+#else
+#define REQUEST_MAX           512  // request path or form body
+#define HTTP_TIMEOUT_MS       3000 // connect, send and receive timeout of a server request
+#define HTTP_RESPONSE_MAX     512  // status line, headers and body of a server answer
+#define SERVER                serverIp, serverPort
+char serverIp[64] = SERVER_IP; // --server host:port
+char serverPort[8] = SERVER_PORT;
+#endif
+STATION_LOCAL uint stationId = STATION_ID; // --station on Linux
+
+/*
+ * Heartbeat: station state pushed to the server, delta-encoded against the state the receiver
+ * acknowledged last. X(id, name, trigger): a changed trigger field is sent within HEARTBEAT_MIN_MS,
+ * or at once together with a record upload, the other fields ride along.
+ */
+#define HEARTBEAT_MS          60000 // heartbeat even if nothing changed
+#define HEARTBEAT_MIN_MS      5000  // gap before a changed trigger field is sent on its own
+#define HB_UPLINK_FIELDS      6     // fields per MSG_HEARTBEAT, a record still fits in the frame
+#define HEARTBEAT_FIELDS(X) \
+	X(HB_SLOT_1,        "slot1",         1) /* umbrella in slot 1 */ \
+	X(HB_SLOT_2,        "slot2",         1) \
+	X(HB_LOCK,          "lockPosition",  1) /* total_time, 0: locked */ \
+	X(HB_UNLOCKS,       "unlocks",       0) \
+	X(HB_SPI_STEP,      "spiStep",       1) \
+	X(HB_SPI_DROPS,     "spiDrops",      1) \
+	X(HB_CARD_ERRORS,   "cardErrors",    0) \
+	X(HB_QUEUED,        "queued",        0) /* uplink bytes waiting on a node, 0 on Linux */ \
+	X(HB_DROPPED,       "dropped",       1) /* records whose upload failed (Linux) or uplink frames given up (node) */ \
+	X(HB_POLL_MAX_US,   "pollLateMaxUs", 0) /* pollJitter */ \
+	X(HB_POLL_MISSES,   "pollMisses",    0) \
+	X(HB_TX_MAX_US,     "txLateMaxUs",   0) /* transceiveJitter */ \
+	X(HB_TX_MISSES,     "txMisses",      0) \
+	X(HB_SERVER_AVG_MS, "serverAvgMs",   0) /* serverTime */ \
+	X(HB_SERVER_MAX_MS, "serverMaxMs",   0) \
+	X(HB_BOOT_MS,       "bootMs",        0) /* boot to the first card poll */
+#define HEARTBEAT_ENUM(id, name, trigger) id,
+#define HEARTBEAT_TRIGGER(id, name, trigger) | ((uint32_t)(trigger) << id)
+enum
+{
+	HEARTBEAT_FIELDS(HEARTBEAT_ENUM)
+	HB_FIELDS
+};
+const uint32_t heartbeatTriggers = 0 HEARTBEAT_FIELDS(HEARTBEAT_TRIGGER);
+const uint32_t heartbeatAll = ((uint32_t)1 << HB_FIELDS) - 1;
+#ifndef NODE
+#define HEARTBEAT_NAME(id, name, trigger) name,
+const char *heartbeatNames[HB_FIELDS] = { HEARTBEAT_FIELDS(HEARTBEAT_NAME) };
+#endif
+typedef struct
+{
+	int value[HB_FIELDS]; // state to report, clamped to 16 bits for the uplink
+	int acked[HB_FIELDS]; // state the receiver holds
+	uchar valid; // acked[] is known to the receiver, 0: the next heartbeat carries every field
+	uchar pending; // gateway: a node heartbeat is waiting to be forwarded
+	uint32_t known; // node: fields whose acked[] value the gateway holds, gateway: fields the node has reported
+	uint32_t queued, inFlight; // node: fields in the uplink queue and in the frame in flight
+	int sent[HB_FIELDS]; // node: values of the queued and in-flight fields
+	uchar more; // node: fields of this heartbeat are still waiting for room in the uplink queue
+	uint seq; // heartbeats sent
+	unsigned long sentMs; // uplink_ms() of the last heartbeat
+} Heartbeat;
+STATION_LOCAL Heartbeat heartbeat; // this station
+#ifndef NODE
+STATION_LOCAL uchar recordSent = 0; // a record went out in the last session, the heartbeat follows it
+STATION_LOCAL unsigned long recordsDropped = 0; // records whose upload failed, they are not sent again
+#endif
+
+/*
+ * Uplink between the sensor nodes and the gateway, a framed binary protocol over the UART:
+ * frame   SOF, payload length, sequence, ack, payload, CRC-16/CCITT over length to payload (big endian)
+ * payload messages of type, data length, data; several messages share one frame
+ * After the SOF, a 0x7E or 0x7D byte goes out as 0x7D and the byte XOR 0x20, so a SOF always starts a frame
+ * Sequence numbers run 1-255, a frame with sequence 0 only carries the ack. The ack names the
+ * last frame received, one data frame is in flight per direction and is sent again until acked.
+ * A frame that starts with MSG_HELLO is always accepted, the peer has restarted its numbering.
+ */
+#define UPLINK_SOF            0x7E
+#define UPLINK_ESC            0x7D
+#define UPLINK_PAYLOAD_MAX    32
+#define UPLINK_RETRY_MS       200
+#define UPLINK_RETRIES        5
+#define GATEWAY_LINKS         16
+enum
+{
+	MSG_HELLO = 1,    // station id (2)
+	MSG_STATUS_QUERY, // card serial number (4), card record sequence number (2)
+	MSG_STATUS,       // card serial number (4), user status (1, signed)
+	MSG_RECORD,       // card serial number (4), station id (2), action (1), card record sequence number (2)
+	MSG_HEARTBEAT     // changed fields: HB_* (1), value (2, signed), up to HB_UPLINK_FIELDS
+};
+enum { RX_SOF, RX_LEN, RX_SEQ, RX_ACK, RX_PAYLOAD, RX_CRC_HI, RX_CRC_LO };
+typedef struct
+{
+	int fd; // gateway: serial port, a node always talks on Serial
+	uint stationId; // station at the other end, 0 until its MSG_HELLO
+	// receive
+	uchar rxState, rxLen, rxPos, rxSeq, rxAck;
+	uchar rxEsc; // the last byte was UPLINK_ESC
+	uint rxCrc;
+	uchar rxBuf[UPLINK_PAYLOAD_MAX];
+	uchar lastSeq; // last frame accepted, 0: none
+	uchar ackDue; // a received frame has not been acked yet
+	// transmit
+	uchar nextSeq;
+	uchar txSeq; // frame in flight, 0: none
+	uchar txLen;
+	uchar txBuf[UPLINK_PAYLOAD_MAX];
+	uchar queueLen; // messages for the next frame
+	uchar queue[UPLINK_PAYLOAD_MAX];
+	uchar retries;
+	unsigned long sentMs;
+	unsigned long drops; // frames given up after UPLINK_RETRIES
+} UplinkLink;
+#ifdef NODE
+UplinkLink uplink; // the gateway
+long uplinkQuery; // card serial number of the status query in progress
+int uplinkStatus;
+uchar uplinkAnswered;
+uchar uplinkRecorded; // a record went out in the last session, the heartbeat follows it
+#else
+/*
+ * The gateway loop only moves frames and acks. Every server request runs in the gateway_server
+ * thread, so a slow answer for one node never holds up the others: the loop hands it status
+ * queries, records and heartbeat fields as jobs and sends the MSG_STATUS answers it gets back.
+ */
+#define GATEWAY_JOBS          64
+typedef struct
+{
+	uchar link; // index in gatewayLinks
+	uchar type; // MSG_*
+	uchar len;
+	uchar data[UPLINK_PAYLOAD_MAX];
+	uint station; // station id of the link
+} GatewayJob;
+UplinkLink gatewayLinks[GATEWAY_LINKS];
+GatewayJob gatewayJobs[GATEWAY_JOBS]; // loop -> server thread
+GatewayJob gatewayAnswers[GATEWAY_JOBS]; // server thread -> loop, MSG_STATUS
+uint jobHead = 0, jobCount = 0, answerHead = 0, answerCount = 0;
+pthread_mutex_t gatewayLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t gatewayWake = PTHREAD_COND_INITIALIZER; // a job is waiting
+int gatewayPipe[2] = {-1, -1}; // an answer is waiting, wakes the poll() of the loop
+typedef struct
+{
+	Heartbeat hb; // the node state as reported, forwarded to the server
+	uint station; // station id of the node
+	unsigned long retryAt; // uplink_ms() of the next forward after a failed one, 0: at once
+} GatewayNode;
+GatewayNode gatewayNodes[GATEWAY_LINKS]; // server thread
+#endif
+
+/*
+ * Borrow state record in block 5, read under the same sector 1 authentication at every tap:
+ * byte 0      STATE_MAGIC
+ * byte 1      CARD_CAN_BORROW, CARD_CAN_RETURN or CARD_PENDING
+ * byte 2-3    station id of the last writer
+ * byte 4-7    unix time of the write (seconds since boot on the AVR boards)
+ * byte 8-9    sequence number, incremented on every write
+ * byte 10-11  reserved, 0
+ * byte 12-15  SipHash-2-4 of the card serial number and bytes 0-11, truncated to 32 bits
+ * Multi-byte fields are big endian.
+ */
+#define STATE_BLOCK           5
+#define STATE_SECTOR          1 // sector 1 on the S50 and the S70 alike
+#define STATE_TRAILER         7
+#define QUOTA_BLOCK           6 // borrows left, enforced only once the block is formatted as a value block
+#define STATE_MAGIC           0xB5
+#define STATE_MAC_OFFSET      12
+enum { CARD_CAN_BORROW, CARD_CAN_RETURN, CARD_PENDING }; // the first two match the server user status
+// MAC key shared by all stations, replace it before deployment
+const uchar stateMacKey[16] PROGMEM =
+{
+	0x53, 0x55, 0x43, 0x2D, 0x73, 0x74, 0x61, 0x74, 0x65, 0x2D, 0x6B, 0x65, 0x79, 0x2D, 0x30, 0x31
+};
+
+// Card types served by the station, looked up by the SAK of the last cascade level; any other card is dropped after selection.
+// The ATQA is only a hint: 0x4400 comes from Ultralight/NTAG cards and from Classic cards with a 7-byte UID alike.
+#define NDEF_MAGIC            0xE1 // first byte of the capability container in page 3 of an NDEF formatted card
+#define NDEF_TLV              0x03 // NDEF message TLV
+enum { CARD_CLASSIC, CARD_ULTRALIGHT };
+typedef struct
+{
+	uchar sak;
+	uchar family; // CARD_CLASSIC: sector keys and 16-byte blocks, CARD_ULTRALIGHT: no authentication, 4-byte pages
+	uchar uidLen; // 4: single size UID, 7: double size UID over two cascade levels, set by card_select
+	uchar stateBlock; // block, or first page, of the borrow state record
+} CardType;
+const CardType cardTypes[] PROGMEM =
+{
+	{0x08, CARD_CLASSIC, 0, STATE_BLOCK}, // Mifare_One S50 (Classic 1K)
+	{0x18, CARD_CLASSIC, 0, STATE_BLOCK}, // Mifare_One S70 (Classic 4K)
+	{0x00, CARD_ULTRALIGHT, 0, 4}, // Mifare_UltraLight and NTAG21x, pages 4-7 or the end of the NDEF data area
+};
+STATION_LOCAL CardType cardType; // type of the card in the field
+
+// Card serial number: 4 bytes (single size UID) or 7 bytes (double size UID), the driver functions take 4 bytes and the check byte
+STATION_LOCAL uchar serNum[7] = {0};
+STATION_LOCAL uchar cardInField = 1; // the last card request had an answer, EV_WAIT_CARD follows when it has none
+
+// Card session: the card served last is woken from HALT with WUPA at each poll, while it answers
+// nothing runs again. Away for less than sessionWindow, the same card is still the same session.
+// Only a session that reached a borrow or return decision starts one, a failed one is tried again at the next tap.
+#define SESSION_WINDOW_MS     3000
+typedef struct
+{
+	uchar active;
+	uchar held; // the card has been on the reader since the last poll, EV_CARD_HELD is logged once per hold
+	uchar uid[4]; // cascade level 1 serial number, the cascade tag and 3 bytes of a double size UID
+	unsigned long lastSeen; // millis() of the last answer
+} CardSession;
+STATION_LOCAL CardSession session = {0};
+uint sessionWindow = SESSION_WINDOW_MS; // --session-window
 uchar writeDate[16] = "umbrella";
 // Password(Key A) of each sector, the total number of sectors is 16, the password of each sector is 6 bytes
-uchar sectorKeyA[16][6] =
+const uchar sectorKeyA[16][6] PROGMEM =
 {
 								{0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
 								{0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
@@ -147,33 +563,69 @@ uchar sectorKeyA[16][6] =
  * 7th byte to 10th byte is Access Bits
  * 11th byte to 16 bytes is Key B
  */
-uchar sectorNewKey[16][16] =
+// Sector 1 holds the borrow state record, a card still on the transport key gets these keys at its first tap.
+// Key A and Key B are shared by all stations, replace them before deployment.
+const uchar sectorNewKey[16][16] PROGMEM =
 {
 								{0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
-                                {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xff,0x07,0x80,0x69, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
+                                {0x53, 0x55, 0x43, 0x4B, 0x41, 0x31, 0xff,0x07,0x80,0x69, 0x53, 0x55, 0x43, 0x4B, 0x42, 0x31},
                                 {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xff,0x07,0x80,0x69, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
 };					
 
 /* MFRC522 defined function */
 void MFRC522_Halt(void);
 uchar MFRC522_Write(uchar blockAddr, uchar *writeData);
+uchar MFRC522_WritePage(uchar page, uchar *writeData);
+uchar MFRC522_ValueFormat(uchar blockAddr, long value);
+uchar MFRC522_ValueRead(uchar blockAddr, long *value);
+uchar MFRC522_ValueOp(uchar command, uchar blockAddr, long value);
+uchar MFRC522_Increment(uchar blockAddr, long delta);
+uchar MFRC522_Decrement(uchar blockAddr, long delta);
+uchar MFRC522_Restore(uchar blockAddr);
+uchar MFRC522_Transfer(uchar blockAddr);
+uchar MFRC522_DecrementCheck(uchar blockAddr, long delta, long *value);
 uchar MFRC522_Read(uchar blockAddr, uchar *recvData);
 uchar MFRC522_Auth(uchar authMode, uchar BlockAddr, uchar *Sectorkey, uchar *serNum);
 uchar MFRC522_SelectTag(uchar *serNum);
+uchar MFRC522_SelectLevel(uchar level, uchar *serNum, uchar *sak);
 void CalulateCRC(uchar *pIndata, uchar len, uchar *pOutData);
 uchar MFRC522_Anticoll(uchar *serNum);
+uchar MFRC522_AnticollLevel(uchar level, uchar *serNum);
 uchar MFRC522_ToCard(uchar command, uchar *sendData, uchar sendLen, uchar *backData, uint *backLen);
 uchar MFRC522_Request(uchar reqMode, uchar *TagType);
-void MFRC522_Init(void);
-void MFRC522_Reset(void);
+uchar MFRC522_Init(void);
+uchar MFRC522_Reset(void);
 void AntennaOff(void);
 void AntennaOn(void);
 void ClearBitMask(uchar reg, uchar mask);
 void SetBitMask(uchar reg, uchar mask);
 uchar Read_MFRC522(uchar addr);
 void Write_MFRC522(uchar addr, uchar val);
-void reg_read_write_test(uchar addr, uchar val);
-void card_type_indentify(uint cardTypeID);
+void init_table_write(void);
+uchar reg_read_write_test(uchar addr, uchar val);
+uchar reg_pattern_test(void);
+void spi_clock_set(uchar step);
+int spi_clock_load(void);
+void spi_clock_save(void);
+uchar spi_clock_calibrate(void);
+void spi_clock_check(void);
+uchar card_type_indentify(uchar sak);
+uchar card_select(uchar *uid, uchar *sak);
+uchar card_auth_state(uchar *uid);
+uchar card_provision(uchar *uid);
+uchar card_ndef_layout(void);
+void rf_profile_apply(RFProfile *profile);
+void rf_profile_load(void);
+#ifdef GALILEO
+void rf_profile_save(void);
+uchar rf_tune_sweep(uchar *field, const uchar *values, uchar count, const char *name);
+void rf_tune(void);
+#endif
+
+/* Boot defined function */
+void boot_stage(const char *name);
+void boot_reader(void);
+void boot_ready(void);
 
 /* L298 defined function */
 void L298_init();
@@ -182,33 +634,166 @@ void reversal(double time);
 void slow_stop();
 void reset_motor();
 
-/* Database defined function */
-void insert(char *colum1, int value1, char *colum2, int value2, char *colum3, int value3, char *ip, char *port, char *table);
-void retrieval_user_status(char *ip, char *port, char *SN);
+/* GPIO event defined function */
+int gpio_edge_open(int gpio, const char *edge);
+int gpio_edge_wait(int *fds, int count, int timeoutMs);
+int station_wait(int timeoutMs);
+int irq_wait(int timeoutMs);
+int slot_read(int pin);
+
+/* SPI trace defined function */
+#ifdef GALILEO
+uchar trace_open(const char *path, uchar mode);
+int trace_value(uchar type, uchar addr, int val);
+int trace_peek(uchar type);
+void trace_flush(void);
+void trace_end(void);
+#else
+#define trace_value(type, addr, val) (val)
+#define trace_peek(type) 0
+#define trace_flush()
+#endif
+
+/* Event log defined function, the load generator runs without it (its stations would share one ring) */
+#if defined(GALILEO) && !defined(LOADGEN)
+void evlog_open(void);
+void evlog_put(const EvRecord *e);
+void evlog(uint16_t id, uint16_t a, int32_t b, int32_t c);
+void evlog_release(void);
+#else
+#define evlog_open()
+#define evlog(id, a, b, c)
+#define evlog_release()
+#endif
+
+/* Real-time defined function */
+void rt_init(int priority);
+void rt_enter(void);
+void rt_leave(void);
+void jitter_add(JitterStat *stat, unsigned long elapsed, unsigned long deadline);
+#ifdef GALILEO
+void jitter_report(JitterStat *stat, const char *name);
+#endif
+
+/* Card state defined function */
+uint64_t siphash24(const uchar *key, const uchar *in, uchar len);
+uint32_t card_state_mac(const uchar *record, const uchar *uid);
+int card_state_verify(const uchar *record, const uchar *uid, uint *seq);
+uchar card_state_write(uchar state, uint seq, const uchar *uid);
+uchar card_quota_refund(long *quota);
+uchar card_wake(const uchar *uid);
+uchar card_reselect(uchar *uid);
+uint32_t station_time(void);
+
+/* Card session defined function */
+void session_begin(const uchar *uid);
+uchar session_expired(void);
+uchar session_held(void);
+
+/* Bus budget defined function */
+#ifdef HOST
+int spi_budget_check(void);
+#endif
+
+/* Database defined function, string arguments are PSTR() flash strings */
+#ifndef NODE
+void request_begin(void);
+void request_P(const char *s);
+void request_long(long v);
+#ifdef LOADGEN
+int http_connect(const char *ip, const char *port, uchar wait);
+void http_connect_start(const char *ip, const char *port);
+int http_connect_finish(void);
+#endif
+int http_request(const char *ip, const char *port, const char *method, const char *path, const char *headers, const char *body, char *response, int size);
+#endif
+void insert(const char *colum1, long value1, const char *colum2, long value2, const char *colum3, long value3, const char *colum4, long value4, const char *ip, const char *port, const char *table);
+int retrieval_user_status(const char *ip, const char *port, long SN, uint seq);
+
+/* Uplink defined function */
+unsigned long uplink_ms(void);
+void uplink_open(UplinkLink *link, int fd);
+uint uplink_crc(uint crc, uchar b);
+void uplink_put32(uchar *p, uint32_t v);
+uint32_t uplink_get32(const uchar *p);
+void uplink_frame(UplinkLink *link, uchar seq, const uchar *payload, uchar len);
+uchar uplink_send(UplinkLink *link, uchar type, const uchar *data, uchar len);
+void uplink_flush(UplinkLink *link);
+void uplink_receive(UplinkLink *link, uchar c);
+void uplink_message(UplinkLink *link, uchar type, const uchar *data, uchar len);
+void uplink_poll(UplinkLink *link);
+#ifndef NODE
+int gateway_port(const char *path);
+void gateway_job(UplinkLink *link, uchar type, const uchar *data, uchar len);
+void gateway_job_run(GatewayJob *job);
+void gateway_forward(void);
+void *gateway_server(void *arg);
+void gateway_answer(void);
+int gateway_run(char **ports, int count, int ptys);
+#endif
+
+/* Heartbeat defined function */
+int heartbeat_clamp(unsigned long v);
+void heartbeat_sample(Heartbeat *hb);
+uchar heartbeat_due(Heartbeat *hb, uchar force);
+void heartbeat_poll(uchar force);
+#ifdef NODE
+uchar heartbeat_uplink(Heartbeat *hb);
+void heartbeat_acked(Heartbeat *hb);
+#else
+int heartbeat_post(Heartbeat *hb, uint station);
+#endif
+
+/* Host user defined function */
+#ifdef HOST
+void host_user(unsigned long ms);
+#endif
+
+/* Load generator defined function */
+#ifdef LOADGEN
+void loadgen_sample(struct timespec *start, int code);
+void *loadgen_station(void *arg);
+int loadgen_compare(const void *a, const void *b);
+int loadgen_records(uint id, unsigned long *unique, unsigned long *duplicates);
+int loadgen_run(int stations, int seconds);
+#endif
 						   
 void setup()
 {
+	bootStart = micros();
+	evlog_open();
+#ifdef NODE
+	Serial.begin(BAUD_RATE); // uplink to the gateway
+	uplink_open(&uplink, -1);
+#elif defined(LOADGEN)
+	http_connect_start(SERVER); // the kernel connects while the reader comes up
+#endif
+	
 	SPI.begin();  // start the SPI library
 	pinMode(chipSelectPin, OUTPUT); // Set digital pin 10 as OUTPUT to connect it to the RFID ENABLE pin(SDA or SS or CS)
     digitalWrite(chipSelectPin, LOW); // Activate the RFID reader
 	pinMode(NRSTPD, OUTPUT); // Set digital pin 5, Not Reset and Power-down
-    digitalWrite(NRSTPD, HIGH);
-	
-	MFRC522_Reset();
-	
-	// MFRC522 Register W/R Test
-	reg_read_write_test(TPrescalerReg, 0x3E);
+    digitalWrite(NRSTPD, HIGH); // the reader starts its oscillator meanwhile
 	
-	puts("MFRC522 Initialization...");
-	MFRC522_Init();
-	
-	puts("L298 Initialization...");
+	PUTS("L298 Initialization...");
 	L298_init();
 	
 	pinMode(green, OUTPUT);
 	
 	pinMode(ubl_1, INPUT);
 	pinMode(ubl_2, INPUT);
+	pinMode(irq, INPUT);
+	
+	ublFd[0] = gpio_edge_open(UBL_1_GPIO, "both");
+	ublFd[1] = gpio_edge_open(UBL_2_GPIO, "both");
+	irqFd = gpio_edge_open(IRQ_GPIO, "falling");
+	if(irqFd < 0)
+		PUTS("MFRC522 IRQ not available, polling CommIrqReg");
+	rf_profile_load();
+	boot_stage("actuator, slots and caches");
+	
+	boot_reader();
+	boot_stage("reader");
 }
 
 void loop()
@@ -216,109 +801,187 @@ void loop()
 	uchar i;
 	uchar status;
     uchar str[MAX_LEN]; // temporary
-    uchar cardSize; // record the card capacity
-    uchar blockAddr; // select the operating block address: 0 to 63
-	uint cardTypeID;
-	int serialNumber; // RFID card serial number(integer)
-	char SN[32]; // RFID card serial number(string)
-	memset(SN, 0, sizeof(SN));
+	uchar sak; // select acknowledge, decides the card type
+	long serialNumber; // RFID card serial number(integer)
 	memset(str, 0, sizeof(str));
 	
 	int userStatus = -1; // user borrrow/return status
 	int ubl_1_v, ubl_2_v; // umbrella check value
 	int umbrella; // initial the number of umbrella in can
+	int cardState = -1; // borrow state record on the card, -1 if there is no valid one
+	uint seq = 0; // sequence number of the card record
+	int decided; // user status the slot opened for
+	uchar fromCard; // the user status was taken from the card record, the server has not been asked
+	uchar authOk, written = 0;
+	long quota = 0; // borrows left on the card
+	uchar hasQuota = 0, noQuota = 0, charged = 0;
+	
+#ifdef GALILEO
+	if(pollJitter.count >= RT_REPORT_INTERVAL)
+	{
+		jitter_report(&pollJitter, "Card poll wakeup");
+		jitter_report(&transceiveJitter, "Transceive");
+	}
+#endif
+	pollStart = micros();
+	
+	if(++spiCheckCount >= SPI_CHECK_INTERVAL)
+	{
+		spiCheckCount = 0;
+		spi_clock_check();
+	}
+#ifdef NODE
+	uplink_poll(&uplink); // acks, retransmissions and records still queued for the gateway
+	if(bootPollUs != 0) // the first card poll goes before the first heartbeat
+	{
+		heartbeat_poll(uplinkRecorded);
+		uplinkRecorded = 0;
+	}
+#else
+	if(bootPollUs != 0) // the first card poll goes before any server request
+	{
+		heartbeat_poll(recordSent); // the slot change of the last session follows its record
+		recordSent = 0;
+	}
+#endif
+	
+	rt_enter(); // card polling runs at real-time priority in --rt mode
+	if(bootPollUs == 0)
+		boot_ready(); // no wait before the first card request
+	else if(station_wait(CARD_POLL_MS) == 0) // sleep until a slot changes or the next card request is due
+	{
+		jitter_add(&pollJitter, micros() - pollStart, CARD_POLL_MS * 1000UL);
+	}
 		
-	puts("Wait for a card...");
-	// Looking for the card and return the card type to array str
-	status = MFRC522_Request(PICC_REQIDL, str);
+	// Looking for the card and return the card type to array str, WUPA also wakes the card of the last session in HALT
+	status = MFRC522_Request(session.active ? PICC_REQALL : PICC_REQIDL, str);
 	if (status == MI_OK)
-	{	puts("Find out a card...");
-		cardTypeID = (str[0] << 8) + str[1];
-		//printf("cardTypeID = 0x%X\n", cardTypeID);
-		card_type_indentify(cardTypeID);
+	{
+		cardInField = 1;
+		// The card of the last session still on the reader, or back within the window: skip it
+		if(session.active && session_held())
+		{
+			rt_leave();
+			return;
+		}
+		evlog(EV_CARD_FOUND, (str[0] << 8) + str[1], 0, 0); // the ATQA, a hint only
 	}	
-	else if(status == MI_NOTAGERR)
-		puts("No tag error!");
-	//if(status == MI_ERR)
-		//puts("No Card.");
+	else
+	{
+		if(cardInField) // logged once when the field empties, not at every poll
+			evlog(EV_WAIT_CARD, 0, 0, 0);
+		cardInField = 0;
+		session.held = 0;
+		if(session.active && session_expired())
+			session.active = 0; // the card has been away long enough, its next tap is a new session
+		//if(status == MI_ERR)
+			//puts("No Card.");
+		rt_leave();
+		return; // no card in the field, nothing else to do
+	}
 	
-	// Anti-collision, return the 4-bytes card serial number , the 5th byte is check byte
-	status = MFRC522_Anticoll(str);
-	memcpy(serNum, str, 5);
+	// Anti-collision and selection through the cascade levels the card asks for, then the type from its SAK
+	status = card_select(serNum, &sak);
 	if (status == MI_OK)
+		status = card_type_indentify(sak);
+	if (status != MI_OK)
 	{
-		FILE *fp = fopen("userStatus.txt", "w+");
-		
-		printf("The card's serial number (Hexadecimal separately): 0x%X 0x%X 0x%X 0x%X\n", serNum[0], serNum[1], serNum[2], serNum[3]);
-		serialNumber = (serNum[0] << 24) + (serNum[1] << 16) + (serNum[2] << 8) + serNum[3];
-		printf("The card's serial number (Decimal): %d\n", serialNumber);
-		sprintf(SN, "%d", serialNumber);
-		printf("SN: %s\n", SN); // int to string
-		retrieval_user_status("140.112.42.93", "3000", SN);  // 向Database詢問使用者是否可借用, command: curl http://140.112.42.93:3000/users/serialNumber/status, //if return 0, user can borrow
-		puts("");
-		delay(1000);
-		fscanf(fp, "%d", &userStatus);
-		printf("userStatus = %d\n", userStatus);
-		fclose(fp);
+		rt_leave();
+		return; // no answer or an unsupported card type
+	}
+	
+	// Read the borrow state record, Ultralight pages need no authentication
+	authOk = card_auth_state(serNum) == MI_OK;
+	if(authOk)
+	{
+		status = MFRC522_Read(cardType.stateBlock, str);
+		evlog(EV_READ, cardType.stateBlock, status, 0);
+		if(status == MI_OK)
+			cardState = card_state_verify(str, serNum, &seq);
+		evlog(EV_CARD_STATE, 0, cardState, seq);
 	}
+	rt_leave(); // the server lookup runs at normal priority, the card stays selected meanwhile
+	
+	i = cardType.uidLen - 4; // the last 4 bytes identify a double size UID, the first one is the manufacturer
+	serialNumber = (int32_t)(((uint32_t)serNum[i] << 24) + ((uint32_t)serNum[i+1] << 16) + ((uint32_t)serNum[i+2] << 8) + serNum[i+3]);
+	evlog(EV_SERIAL, 0, serialNumber, 0);
+	// A return is decided from the card, the server learns about it from the record upload. A borrow always asks:
+	// a CAN_BORROW record copied off the card and written back later still verifies, only the server can tell
+	// from the sequence number that it is old.
+	fromCard = cardState == CARD_CAN_RETURN;
+	if(fromCard)
+		userStatus = cardState;
+	else
+		userStatus = retrieval_user_status(SERVER, serialNumber, seq);  // 向Database詢問使用者是否可借用, request: GET http://140.112.42.93:3000/users/serialNumber/status, //if return 0, user can borrow
+	evlog(EV_USER_STATUS, 0, userStatus, 0);
 	
 	//userStatus = 0; // for test
 	
-	// Election card, return the card capacity
-	cardSize = MFRC522_SelectTag(serNum);
-	if(cardSize != 0)
-		{ printf("Card size is %uK bits\n", cardSize); }
+	rt_enter(); // back to real-time priority for the rest of the card exchange, up to MFRC522_Halt
 	
-	// Read data for run the RFID read process complete.
-	blockAddr = 7;	
-	status = MFRC522_Auth(PICC_AUTHENT1A, blockAddr, sectorNewKey[blockAddr/4], serNum); // authentication
-	if(status == MI_OK)
+	ubl_1_v = slot_read(ubl_1); // check umbrella state
+	ubl_2_v = slot_read(ubl_2);
+	umbrella = ubl_1_v + ubl_2_v;
+	evlog(EV_UMBRELLA, umbrella, ubl_1_v, ubl_2_v);
+	
+	if(authOk && userStatus == 0 && cardType.family == CARD_CLASSIC)
 	{
-		puts("Authentication successfully!");
-		blockAddr = blockAddr - 3;
-		//printf("Read data from <block %u>\n", blockAddr);
-		status = MFRC522_Read(blockAddr, str);
-		if(status == MI_OK)
+		hasQuota = MFRC522_ValueRead(QUOTA_BLOCK, &quota) == MI_OK;
+		noQuota = hasQuota && quota <= 0;
+		if(hasQuota)
+			evlog(EV_QUOTA, 0, quota, 0);
+	}
+	
+	// Charge the quota and write the state after the session before a slot opens, the card is rarely still on the reader when the slot locks
+	if(authOk && !noQuota && ((userStatus == 0 && (ubl_1_v == HIGH || ubl_2_v == HIGH)) || (userStatus == 1 && (ubl_1_v == LOW || ubl_2_v == LOW))))
+	{
+		if(hasQuota)
 		{
-			//puts("The data is : ");
-			for(i = 0; i < 16; i++)
-			{
-				//printf("%c", str[i]);
-			}
-			printf("Card data read complete.\n");
+			charged = MFRC522_DecrementCheck(QUOTA_BLOCK, 1, &quota) == MI_OK;
+			evlog(EV_QUOTA, 0, quota, charged ? MI_OK : MI_ERR);
 		}
+		if(charged || !hasQuota)
+			written = card_state_write(!userStatus, seq + 1, serNum) == MI_OK;
+		if(written)
+			seq++; // the record upload tells the server the sequence number now on the card
+		else if(hasQuota && !charged)
+			userStatus = -1; // the borrow cannot be charged
+		else if(fromCard)
+			userStatus = -1; // the card would keep its old state and the server has not been asked
 	}
+	decided = userStatus;
 	MFRC522_Halt(); // command card into hibernation
+	rt_leave();
+	trace_flush();
 	
-	ubl_1_v = digitalRead(ubl_1); // check umbrella state
-	ubl_2_v = digitalRead(ubl_2);
-	umbrella = ubl_1_v + ubl_2_v;
-	printf("The initial number of umbrella: %d\n", umbrella);
-	
-	if(userStatus == 0) // user can borrow umbrella
+	if(userStatus == 0 && noQuota) // the card quota is used up
+	{
+		evlog(EV_NO_QUOTA, 0, quota, 0);
+	}
+	else if(userStatus == 0) // user can borrow umbrella
 	{		
 
 		//ubl_1_v = HIGH; // for test
 		//ubl_2_v = HIGH; // for test
-		printf("ubl_1_v = %d, ubl_2_v = %d\n", ubl_1_v, ubl_2_v);
 		if(ubl_1_v == LOW && ubl_2_v == LOW)
 		{
-			puts("EMPTY!");
+			evlog(EV_EMPTY, 0, 0, 0);
 		}		
 		else if(ubl_1_v == HIGH)
 		{
 			digitalWrite(green, HIGH);
-			puts("START UNLOCK");
+			evlog(EV_UNLOCK, 1, 0, 0);
 			forward(24); // unlock
 			delay(10000);
 			reversal(24); // lock
-			puts("LOCKED");
-			ubl_1_v = digitalRead(ubl_1);
+			evlog(EV_LOCK, 1, 0, 0);
+			ubl_1_v = slot_read(ubl_1);
 			if(ubl_1_v == LOW)
 			{
-				insert("userCard", serialNumber, "stationId", 12, "action", 0, "140.112.42.93", "3000", "records"); // action = 0: borrow umbrella
+				insert(PSTR("userCard"), serialNumber, PSTR("stationId"), stationId, PSTR("action"), 0, PSTR("cardSeq"), seq, SERVER, PSTR("records")); // action = 0: borrow umbrella
 				umbrella = umbrella - 1;
-				printf("\nThe number of umbrella: %d\n", umbrella);
+				evlog(EV_UMBRELLA, umbrella, slot_read(ubl_1), slot_read(ubl_2));
+				userStatus = 1;
 			}
 		}
 		else if(ubl_2_v == HIGH)
@@ -327,23 +990,24 @@ void loop()
 			//forward(); // unlock
 			delay(10000);
 			//reversal(); // lock
-			ubl_2_v = digitalRead(ubl_2);
+			ubl_2_v = slot_read(ubl_2);
 			if(ubl_2_v == LOW)
 			{	
-				insert("userCard", serialNumber, "stationId", 12, "action", 0, "140.112.42.93", "3000", "records"); // action = 0: borrow umbrella
+				insert(PSTR("userCard"), serialNumber, PSTR("stationId"), stationId, PSTR("action"), 0, PSTR("cardSeq"), seq, SERVER, PSTR("records")); // action = 0: borrow umbrella
 				umbrella = umbrella - 1;
-				printf("\nThe number of umbrella: %d\n", umbrella);
+				evlog(EV_UMBRELLA, umbrella, slot_read(ubl_1), slot_read(ubl_2));
+				userStatus = 1;
 			}
 		}
 		digitalWrite(green, LOW);
 	}
 	else if(userStatus == 1) // user can return umbrella
 	{
-		ubl_1_v = digitalRead(ubl_1); // check umbrella state
-		ubl_2_v = digitalRead(ubl_2);
+		ubl_1_v = slot_read(ubl_1); // check umbrella state
+		ubl_2_v = slot_read(ubl_2);
 		if(ubl_1_v == HIGH && ubl_2_v == HIGH)
 		{
-			puts("FULL!");
+			evlog(EV_FULL, 0, 0, 0);
 		}				
 		else if(ubl_1_v == LOW)
 		{
@@ -351,12 +1015,13 @@ void loop()
 			forward(24); // unlock
 			delay(10000);
 			reversal(24); // lock
-			ubl_1_v = digitalRead(ubl_1);
+			ubl_1_v = slot_read(ubl_1);
 			if(ubl_1_v == HIGH)
 			{
-				insert("userCard", serialNumber, "stationId", 12, "action", 1, "140.112.42.93", "3000", "records"); // action = 1: return umbrella
+				insert(PSTR("userCard"), serialNumber, PSTR("stationId"), stationId, PSTR("action"), 1, PSTR("cardSeq"), seq, SERVER, PSTR("records")); // action = 1: return umbrella
 				umbrella = umbrella + 1;
-				printf("\nThe number of umbrella: %d\n", umbrella);
+				evlog(EV_UMBRELLA, umbrella, slot_read(ubl_1), slot_read(ubl_2));
+				userStatus = 0;
 			}
 		}
 		else if(ubl_2_v == LOW)
@@ -365,18 +1030,34 @@ void loop()
 			//forward(); // unlock
 			delay(10000);
 			//reversal(); // lock
-			ubl_2_v = digitalRead(ubl_2);
+			ubl_2_v = slot_read(ubl_2);
 			if(ubl_2_v == HIGH)
 			{
-				insert("userCard", serialNumber, "stationId", 12, "action", 1, "140.112.42.93", "3000", "records"); // action = 1: return umbrella
+				insert(PSTR("userCard"), serialNumber, PSTR("stationId"), stationId, PSTR("action"), 1, PSTR("cardSeq"), seq, SERVER, PSTR("records")); // action = 1: return umbrella
 				umbrella = umbrella + 1;
-				printf("\nThe number of umbrella: %d\n", umbrella);
+				evlog(EV_UMBRELLA, umbrella, slot_read(ubl_1), slot_read(ubl_2));
+				userStatus = 0;
 			}
 		}
 		digitalWrite(green, LOW);
 	}
 	else if(userStatus == -1)
-	{ puts("No user status information."); }
+	{ evlog(EV_NO_STATUS, 0, 0, 0); }
+	
+	// Nothing was taken or returned: a card still on the reader gets its borrow back and PENDING, so the server
+	// decides its next tap. A card already gone keeps the state and the charge from before the slot opened.
+	if((written || charged) && userStatus == decided)
+	{
+		status = card_reselect(serNum);
+		if(status == MI_OK && charged)
+			status = card_quota_refund(&quota);
+		if(status == MI_OK)
+			status = card_state_write(CARD_PENDING, ++seq, serNum);
+		MFRC522_Halt();
+		trace_flush();
+	}
+	if(decided != -1)
+		session_begin(serNum); // the window starts when the session ends, the user held the card until the slot locked
 }
 
 /* ----------MFRC522 function---------- */
@@ -389,6 +1070,10 @@ void loop()
  */
 void Write_MFRC522(uchar addr, uchar val)
 {
+	(void)trace_value(TR_WRITE, addr, val);
+	if(traceMode == TRACE_REPLAY)
+		return;
+
 	digitalWrite(chipSelectPin, LOW);
 
 	// address format: 0XXXXXX0
@@ -409,6 +1094,9 @@ uchar Read_MFRC522(uchar addr)
 {
 	uchar val;
 
+	if(traceMode == TRACE_REPLAY)
+		return trace_value(TR_READ, addr, 0);
+
 	digitalWrite(chipSelectPin, LOW);
 
 	// address format: 1XXXXXX0
@@ -417,7 +1105,7 @@ uchar Read_MFRC522(uchar addr)
 	
 	digitalWrite(chipSelectPin, HIGH);
 	
-	return val;
+	return trace_value(TR_READ, addr, val);
 }
 
 void SetBitMask(uchar reg, uchar mask)  
@@ -448,12 +1136,12 @@ void AntennaOn(void)
 		temp = Read_MFRC522(TxControlReg);
 		//printf("After SetBitMask, TxControlReg = %X\n", temp);
 		if(temp == result)
-			puts("Turn on the antenna successfully!");
+			PUTS("Turn on the antenna successfully!");
 		else
-			puts("Turn on the antenna failed...");
+			PUTS("Turn on the antenna failed...");
 	}
 	else
-		puts("The antenna already is on.");
+		PUTS("The antenna already is on.");
 }
 
 /* Turn off the antenna, the operation interval is at least 1ms */
@@ -462,26 +1150,60 @@ void AntennaOff(void)
 	ClearBitMask(TxControlReg, 0x03);
 }
 
-void MFRC522_Reset(void)
+/*
+ * Function: MFRC522_Reset
+ * Description: Soft reset, then wait until the oscillator runs: PowerDown in CommandReg stays set until then
+ * Return value: successful return MI_OK, MI_ERR if PowerDown did not clear within RESET_TIMEOUT_MS
+ */
+uchar MFRC522_Reset(void)
+{
+	unsigned long start = millis();
+
+	Write_MFRC522(CommandReg, PCD_RESETPHASE);
+	while(Read_MFRC522(CommandReg) & 0x10) // PowerDown
+	{
+		if(millis() - start >= RESET_TIMEOUT_MS)
+			return MI_ERR;
+	}
+	return MI_OK;
+}
+
+/* Write the initTable register sequence */
+void init_table_write(void)
 {
-    Write_MFRC522(CommandReg, PCD_RESETPHASE);
+	uchar i;
+
+	for(i = 0; i < sizeof(initTable)/sizeof(initTable[0]); i++)
+	{
+		Write_MFRC522(pgm_read_byte(&initTable[i][0]), pgm_read_byte(&initTable[i][1]));
+	}
 }
 
-void MFRC522_Init(void)
+/*
+ * Function: MFRC522_Init
+ * Description: Set up the MFRC522 after MFRC522_Reset, then read the initTable registers
+ *              and the antenna driver bits back
+ * Return value: successful return MI_OK, MI_ERR if a register does not hold what was written
+ */
+uchar MFRC522_Init(void)
 {
+	uchar i, mask;
+
 	digitalWrite(NRSTPD,HIGH);
-	MFRC522_Reset();	
-	// Timer: TPrescaler * TreloadVal/6.78MHz = 24ms
-    Write_MFRC522(TModeReg, 0x8D); // Tauto = 1; f(Timer) = 6.78MHz/TPreScaler
-    Write_MFRC522(TPrescalerReg, 0x3E); // TModeReg[3..0] + TPrescalerReg
-    Write_MFRC522(TReloadRegL, 30);
-    Write_MFRC522(TReloadRegH, 0);
-	Write_MFRC522(TxAutoReg, 0x40);	// 100%ASK
-	Write_MFRC522(ModeReg, 0x3D); // CRC初始值0x6363
+	init_table_write(); // also undoes the register pattern test of the calibration
 	//ClearBitMask(Status2Reg, 0x08); // MFCrypto1On = 0
 	//MFRC522_HAL_write(RxSelReg, 0x86); // RxWait = RxSelReg[5..0]
-	//MFRC522_HAL_write(RFCfgReg, 0x7F); // Configures the receiver gain, 48db
+	rf_profile_apply(&rfProfile); // receiver gain, threshold and driver conductance
 	AntennaOn(); // Turn on the antenna
+	for(i = 0; i < sizeof(initTable)/sizeof(initTable[0]); i++)
+	{
+		mask = pgm_read_byte(&initTable[i][2]);
+		if((Read_MFRC522(pgm_read_byte(&initTable[i][0])) & mask) != (pgm_read_byte(&initTable[i][1]) & mask))
+			return MI_ERR;
+	}
+	if((Read_MFRC522(TxControlReg) & 0x03) != 0x03) // Tx1RFEn, Tx2RFEn
+		return MI_ERR;
+	return MI_OK;
 }
 
 /*
@@ -532,6 +1254,7 @@ uchar MFRC522_ToCard(uchar command, uchar *sendData, uchar sendLen, uchar *backD
     uchar lastBits;
     uchar n;
     uint i;
+	unsigned long start;
 
     switch(command)
     {
@@ -551,8 +1274,9 @@ uchar MFRC522_ToCard(uchar command, uchar *sendData, uchar sendLen, uchar *backD
 			break;
     }
    
-    Write_MFRC522(CommIEnReg, irqEn|0x80); // allow the interrupt request
+    Write_MFRC522(CommIEnReg, waitIRq|0x01|0x80); // the IRQ pin (inverted) follows the awaited bits and TimerIRq
     ClearBitMask(CommIrqReg, 0x80); // Clear all interrupt request bit
+    gpio_edge_wait(&irqFd, 1, 0); // discard an edge left from the previous command
     SetBitMask(FIFOLevelReg, 0x80);	// FlushBuffer = 1, the FIFO initialization
     Write_MFRC522(CommandReg, PCD_IDLE); // no action, cancels current command execution
 
@@ -563,6 +1287,7 @@ uchar MFRC522_ToCard(uchar command, uchar *sendData, uchar sendLen, uchar *backD
 	}
 
 	// Execute Command
+	start = micros();
 	Write_MFRC522(CommandReg, command);
     if (command == PCD_TRANSCEIVE)
     {    
@@ -573,12 +1298,18 @@ uchar MFRC522_ToCard(uchar command, uchar *sendData, uchar sendLen, uchar *backD
 	i = 2000;	// according to the clock frequency to adjust i, the maximum operation wait time for M1 card: 25ms
     do 
     {
+		// sleep until the IRQ pin asserts, a missing edge means the card timer did not even fire
+		if(irq_wait(TOCARD_TIMEOUT_MS) == 0)
+		{
+			i = 1;
+		}
 		// CommIrqReg[7..0]
 		// Set1 TxIRq RxIRq IdleIRq HiAlerIRq LoAlertIRq ErrIRq TimerIRq
         n = Read_MFRC522(CommIrqReg);
         i--;
     }
     while((i != 0) && !(n&0x01) && !(n&waitIRq));
+	jitter_add(&transceiveJitter, micros() - start, TOCARD_TIMEOUT_MS * 1000UL);
 
     ClearBitMask(BitFramingReg, 0x80); // StartSend = 0
 	
@@ -633,6 +1364,8 @@ uchar MFRC522_ToCard(uchar command, uchar *sendData, uchar sendLen, uchar *backD
     }	
     //SetBitMask(ControlReg,0x80); // timer stops
     //Write_MFRC522(CommandReg, PCD_IDLE); 
+	if(status == MI_ERR)
+		cardErrors++;
 	return status;
 }
 
@@ -643,6 +1376,19 @@ uchar MFRC522_ToCard(uchar command, uchar *sendData, uchar sendLen, uchar *backD
  * Return values: successful return MI_OK
  */
 uchar MFRC522_Anticoll(uchar *serNum)
+{
+	return MFRC522_AnticollLevel(PICC_ANTICOLL, serNum);
+}
+
+/*
+ * Function: MFRC522_AnticollLevel
+ * Description: anti-collision detection at one cascade level
+ * Input parameters:
+ *					level  - PICC_ANTICOLL (cascade level 1) or PICC_ANTICOLL2 (cascade level 2)
+ *					serNum - return the 4 serial number bytes of this level, the 5th byte is the checksum byte
+ * Return values: successful return MI_OK
+ */
+uchar MFRC522_AnticollLevel(uchar level, uchar *serNum)
 {
     uchar status;
     uchar i;
@@ -653,7 +1399,7 @@ uchar MFRC522_Anticoll(uchar *serNum)
     //ClearBitMask(CollReg,0x80);// ValuesAfterColl
 	Write_MFRC522(BitFramingReg, 0x00); // TxLastBists = BitFramingReg[2..0]
  
-    serNum[0] = PICC_ANTICOLL;
+    serNum[0] = level;
     serNum[1] = 0x20;
     status = MFRC522_ToCard(PCD_TRANSCEIVE, serNum, 2, serNum, &unLen);
 
@@ -697,7 +1443,8 @@ void CalulateCRC(uchar *pIndata, uchar len, uchar *pOutData)
 	}
     Write_MFRC522(CommandReg, PCD_CALCCRC);
 
-	// Wait for the CRC calculation is done
+	// Wait for the CRC calculation is done. No IRQ here: the coprocessor is done within a few
+	// microseconds, before the first read comes back, and a sysfs edge wakeup takes far longer.
     i = 0xFF;
     do 
     {
@@ -720,16 +1467,35 @@ void CalulateCRC(uchar *pIndata, uchar len, uchar *pOutData)
  *					successful return to card capacity in K bits
  */
 uchar MFRC522_SelectTag(uchar *serNum)
+{
+	uchar sak;
+
+	if(MFRC522_SelectLevel(PICC_SElECTTAG, serNum, &sak) != MI_OK)
+	{
+		return 0;
+	}
+	return sak;
+}
+
+/*
+ * Function: MFRC522_SelectLevel
+ * Description: select the card at one cascade level
+ * Input parameters:
+ *					level  - PICC_SElECTTAG (cascade level 1) or PICC_ANTICOLL2 (cascade level 2)
+ *					serNum - the 4 serial number bytes and the check byte from MFRC522_AnticollLevel
+ *					sak    - return the select acknowledge, bit 2 set means the UID continues at the next level
+ * Return values: successful return MI_OK
+ */
+uchar MFRC522_SelectLevel(uchar level, uchar *serNum, uchar *sak)
 {
     uchar i;
 	uchar status;
-	uchar size;
     uint recvBits;
     uchar buffer[9];
 
 	//ClearBitMask(Status2Reg, 0x08); // MFCrypto1On = 0
 
-    buffer[0] = PICC_SElECTTAG;
+    buffer[0] = level;
     buffer[1] = 0x70;
     for(i = 0; i < 5; i++)
     {
@@ -739,14 +1505,14 @@ uchar MFRC522_SelectTag(uchar *serNum)
     status = MFRC522_ToCard(PCD_TRANSCEIVE, buffer, 9, buffer, &recvBits);
     if((status == MI_OK) && (recvBits == 0x18))
     {   
-		size = buffer[0]; 
+		*sak = buffer[0]; 
 	}
     else
     {   
-		size = 0;    
+		status = MI_ERR;    
 	}
 
-    return size;
+    return status;
 }
 
 /*
@@ -851,176 +1617,3035 @@ uchar MFRC522_Write(uchar blockAddr, uchar *writeData)
     return status;
 }
 
-/* command card into hibernation */
-void MFRC522_Halt(void)
+/*
+ * Function: MFRC522_WritePage
+ * Description: Write one page of an Ultralight/NTAG card
+ * Enter parameters: 
+ *					page      - page address,
+ *					writeData - write 4 bytes of data to the page
+ * Return values: successful return MI_OK
+ */
+uchar MFRC522_WritePage(uchar page, uchar *writeData)
 {
-    uint unLen;
-    uchar buff[4];
-    buff[0] = PICC_HALT;
-    buff[1] = 0;
-    CalulateCRC(buff, 2, &buff[2]);
-	MFRC522_ToCard(PCD_TRANSCEIVE, buff, 4, buff, &unLen);
+    uchar status;
+    uint recvBits;
+    uchar i;
+	uchar buff[8]; 
+    
+    buff[0] = PICC_WRITE_PAGE;
+    buff[1] = page;
+    for(i = 0; i < 4; i++)
+    {
+		buff[i+2] = *(writeData+i);   
+    }
+    CalulateCRC(buff, 6, &buff[6]);
+    status = MFRC522_ToCard(PCD_TRANSCEIVE, buff, 8, buff, &recvBits);
+	if((status != MI_OK) || (recvBits != 4) || ((buff[0] & 0x0F) != 0x0A))
+    {
+		status = MI_ERR;   
+	}
+    return status;
 }
 
-/* MFRC522 Register W/R Test */
-void reg_read_write_test(uchar addr, uchar val)
+/*
+ * Value block layout (MIFARE Classic):
+ * byte 0-3 value, byte 4-7 inverted value, byte 8-11 value (32-bit little endian),
+ * byte 12-15 block address, inverted address, address, inverted address
+ */
+
+/*
+ * Function: MFRC522_ValueFormat
+ * Description: Write a block in value block format
+ * Input parameters:
+ *					blockAddr - block address
+ *					value     - initial value
+ * Return values: successful return MI_OK
+ */
+uchar MFRC522_ValueFormat(uchar blockAddr, long value)
 {
-	volatile uint8_t test = 0;
-	
-	//test = Write_MFRC522(addr);
-	//printf("Before write, Register 0x%x = 0x%x\n", addr, test);
-	Write_MFRC522(addr, val);
-	test = Read_MFRC522(addr);
-	//printf("After write, Register 0x%x = 0x%x, it should be %x\n", addr, test, val);
-	if(test != val)
+	uchar buff[16];
+	uchar i;
+
+	for(i = 0; i < 4; i++)
 	{
-		puts("MFRC522 register W/R test failed...");
-		exit(-1);
+		buff[i] = (uint32_t)value >> (8 * i);
+		buff[i+4] = ~buff[i];
+		buff[i+8] = buff[i];
 	}
-	else
-		puts("MFRC522 register W/R test successfully!");
+	buff[12] = blockAddr;
+	buff[13] = ~blockAddr;
+	buff[14] = blockAddr;
+	buff[15] = ~blockAddr;
+	return MFRC522_Write(blockAddr, buff);
 }
 
-void card_type_indentify(uint cardTypeID)
+/*
+ * Function: MFRC522_ValueRead
+ * Description: Read a value block and check its redundant copies
+ * Input parameters:
+ *					blockAddr - block address
+ *					value     - returns the value
+ * Return values: successful return MI_OK, MI_ERR if the read fails or the block is not a value block
+ */
+uchar MFRC522_ValueRead(uchar blockAddr, long *value)
 {
-	switch(cardTypeID)
-    {
-		case 0x0400: // certification card secret
-		{
-			puts("Card type: Mifare_One S50");
-			break;
-		}
-		
-		case 0x0000:
-			// no card, do nothing
-			break;
-			
-		default:
-			puts("Card type: Unknown");
-			break;
-    }
+	uchar buff[MAX_LEN];
+	uchar status;
+	uchar i;
+
+	status = MFRC522_Read(blockAddr, buff);
+	if(status != MI_OK)
+		return status;
+	for(i = 0; i < 4; i++)
+	{
+		if(buff[i] != buff[i+8] || buff[i] != (uchar)~buff[i+4])
+			return MI_ERR;
+	}
+	if(buff[12] != buff[14] || buff[13] != buff[15] || buff[12] != (uchar)~buff[13])
+		return MI_ERR;
+	*value = (long)(int32_t)((uint32_t)buff[0] | ((uint32_t)buff[1] << 8) | ((uint32_t)buff[2] << 16) | ((uint32_t)buff[3] << 24));
+	return MI_OK;
 }
 
-/* ----------L298 function---------- */
-void L298_init()
+/*
+ * Function: MFRC522_ValueOp
+ * Description: Increment, decrement or restore a value block into the card transfer buffer,
+ *              the block itself only changes with MFRC522_Transfer
+ * Input parameters:
+ *					command   - PICC_INCREMENT, PICC_DECREMENT or PICC_RESTORE
+ *					blockAddr - value block address
+ *					value     - operand, ignored by PICC_RESTORE
+ * Return values: successful return MI_OK
+ */
+uchar MFRC522_ValueOp(uchar command, uchar blockAddr, long value)
 {
-	pinMode(ENA, OUTPUT);
-	pinMode(IN1, OUTPUT);
-	pinMode(IN2, OUTPUT);
-	digitalWrite(ENA, LOW);
-	digitalWrite(IN1, HIGH);
-	digitalWrite(IN2, HIGH);
+	uchar status;
+	uint recvBits;
+	uchar i;
+	uchar buff[6];
+
+	buff[0] = command;
+	buff[1] = blockAddr;
+	CalulateCRC(buff, 2, &buff[2]);
+	status = MFRC522_ToCard(PCD_TRANSCEIVE, buff, 4, buff, &recvBits);
+	if((status != MI_OK) || (recvBits != 4) || ((buff[0] & 0x0F) != 0x0A))
+	{
+		return MI_ERR;
+	}
+
+	for(i = 0; i < 4; i++)
+	{
+		buff[i] = (uint32_t)value >> (8 * i);
+	}
+	CalulateCRC(buff, 4, &buff[4]);
+	status = MFRC522_ToCard(PCD_TRANSCEIVE, buff, 6, buff, &recvBits);
+	// the card only answers the second frame with a NAK, silence until the timer runs out is success
+	if(status == MI_NOTAGERR)
+	{
+		status = MI_OK;
+	}
+	else
+	{
+		status = MI_ERR;
+	}
+	return status;
 }
 
-void forward(double time)
+uchar MFRC522_Increment(uchar blockAddr, long delta)
 {
-	delay(500);
-	digitalWrite(ENA, HIGH);
-	digitalWrite(IN2, LOW);
-	delay(1000*time);
-	digitalWrite(IN2, HIGH);
-	slow_stop();
-	total_time = total_time + time;
-	
+	return MFRC522_ValueOp(PICC_INCREMENT, blockAddr, delta);
 }
 
-void reversal(double time)
+uchar MFRC522_Decrement(uchar blockAddr, long delta)
 {
-	delay(500);
-	digitalWrite(ENA, HIGH);
-	digitalWrite(IN1, LOW);
-	delay(950*time);
-	digitalWrite(IN1, HIGH);
-	slow_stop();
-	total_time = total_time - time;
-	
+	return MFRC522_ValueOp(PICC_DECREMENT, blockAddr, delta);
+}
+
+/* Copy a value block into the transfer buffer, MFRC522_Transfer can then store it in another block of the sector */
+uchar MFRC522_Restore(uchar blockAddr)
+{
+	return MFRC522_ValueOp(PICC_RESTORE, blockAddr, 0);
+}
+
+/*
+ * Function: MFRC522_Transfer
+ * Description: Write the card transfer buffer to a value block
+ * Input parameters:
+ *					blockAddr - block address
+ * Return values: successful return MI_OK
+ */
+uchar MFRC522_Transfer(uchar blockAddr)
+{
+	uchar status;
+	uint recvBits;
+	uchar buff[4];
+
+	buff[0] = PICC_TRANSFER;
+	buff[1] = blockAddr;
+	CalulateCRC(buff, 2, &buff[2]);
+	status = MFRC522_ToCard(PCD_TRANSCEIVE, buff, 4, buff, &recvBits);
+	if((status != MI_OK) || (recvBits != 4) || ((buff[0] & 0x0F) != 0x0A))
+	{
+		status = MI_ERR;
+	}
+	return status;
+}
+
+/*
+ * Function: MFRC522_DecrementCheck
+ * Description: Decrement a value block only if it holds at least delta, the card commits the
+ *              new value in one step with the transfer so a torn session keeps the old value
+ * Input parameters:
+ *					blockAddr - value block address
+ *					delta     - amount to take
+ *					value     - returns the value after the operation, or the current value if it is too low
+ * Return values: successful return MI_OK, MI_ERR if the value is too low or the card fails
+ */
+uchar MFRC522_DecrementCheck(uchar blockAddr, long delta, long *value)
+{
+	uchar status;
+
+	status = MFRC522_ValueRead(blockAddr, value);
+	if(status != MI_OK || *value < delta)
+	{
+		return MI_ERR;
+	}
+	status = MFRC522_Decrement(blockAddr, delta);
+	if(status == MI_OK)
+	{
+		status = MFRC522_Transfer(blockAddr);
+	}
+	if(status == MI_OK)
+	{
+		*value -= delta;
+	}
+	return status;
+}
+
+/* command card into hibernation */
+void MFRC522_Halt(void)
+{
+    uint unLen;
+    uchar buff[4];
+    buff[0] = PICC_HALT;
+    buff[1] = 0;
+    CalulateCRC(buff, 2, &buff[2]);
+	MFRC522_ToCard(PCD_TRANSCEIVE, buff, 4, buff, &unLen);
+}
+
+/* MFRC522 Register W/R Test */
+uchar reg_read_write_test(uchar addr, uchar val)
+{
+	volatile uint8_t test = 0;
+	
+	//test = Write_MFRC522(addr);
+	//printf("Before write, Register 0x%x = 0x%x\n", addr, test);
+	Write_MFRC522(addr, val);
+	test = Read_MFRC522(addr);
+	//printf("After write, Register 0x%x = 0x%x, it should be %x\n", addr, test, val);
+	if(test != val)
+	{
+		return MI_ERR;
+	}
+	return MI_OK;
+}
+
+/*
+ * Function: reg_pattern_test
+ * Description: Write and read back bit patterns on the timer registers and ModWidthReg,
+ *              the caller puts their values back with init_table_write (MFRC522_Init does at boot)
+ * Return value: successful return MI_OK
+ */
+uchar reg_pattern_test(void)
+{
+	static const uchar regs[] PROGMEM = {TPrescalerReg, TReloadRegL, TReloadRegH, ModWidthReg};
+	static const uchar patterns[] PROGMEM = {0x00, 0xFF, 0x55, 0xAA, 0x3E};
+	uchar round, r, p;
+
+	for(round = 0; round < SPI_CAL_ROUNDS; round++)
+	{
+		for(r = 0; r < sizeof(regs); r++)
+		{
+			for(p = 0; p < sizeof(patterns); p++)
+			{
+				if(reg_read_write_test(pgm_read_byte(&regs[r]), pgm_read_byte(&patterns[p])) != MI_OK)
+					return MI_ERR;
+			}
+		}
+	}
+	return MI_OK;
+}
+
+void spi_clock_set(uchar step)
+{
+	spiStep = step;
+	SPI.setClockDivider(pgm_read_byte(&spiDividers[step]));
+}
+
+/* Clock step saved by the last calibration, -1 if there is none or it is older than SPI_CLOCK_MAX_AGE_S. The load generator stations keep none. */
+int spi_clock_load(void)
+{
+	int step = -1;
+#if defined(GALILEO) && !defined(LOADGEN)
+	FILE *fp = fopen(SPI_CLOCK_FILE, "r");
+	struct stat st;
+	time_t now = time(NULL);
+
+	if(fp == NULL)
+		return -1;
+	if(fscanf(fp, "%d", &step) != 1)
+		step = -1;
+	if(fstat(fileno(fp), &st) == 0 && now > st.st_mtime && now - st.st_mtime > SPI_CLOCK_MAX_AGE_S)
+		step = -1; // sweep now and then, a clock set back at boot keeps the saved step
+	fclose(fp);
+#endif
+	return step;
+}
+
+void spi_clock_save(void)
+{
+#if defined(GALILEO) && !defined(LOADGEN)
+	FILE *fp = fopen(SPI_CLOCK_FILE, "w");
+
+	if(fp == NULL)
+		return;
+	fprintf(fp, "%d\n", spiStep);
+	fclose(fp);
+#endif
+}
+
+/*
+ * Function: spi_clock_calibrate
+ * Description: Raise the SPI clock step by step while the register pattern test passes,
+ *              then keep SPI_CLOCK_MARGIN steps below the fastest reliable clock.
+ *              A step saved by an earlier calibration is kept if it passes the test once.
+ * Return value: successful return MI_OK, MI_ERR if even the slowest clock fails
+ */
+uchar spi_clock_calibrate(void)
+{
+	uchar step, saved = 0;
+	int best;
+
+	best = trace_value(TR_STATUS, 2, spi_clock_load()); // through the SPI trace, a replay takes the same path
+	if(best >= 0 && best < (int)sizeof(spiDividers))
+	{
+		spi_clock_set(best);
+		saved = reg_pattern_test() == MI_OK;
+	}
+	if(!saved)
+	{
+		best = -1;
+		for(step = 0; step < sizeof(spiDividers); step++)
+		{
+			spi_clock_set(step);
+			if(reg_pattern_test() != MI_OK)
+				break;
+			best = step;
+		}
+		if(best < 0)
+			return MI_ERR;
+
+		best = best - SPI_CLOCK_MARGIN;
+		if(best < 0)
+			best = 0;
+		spi_clock_set(best);
+		spi_clock_save();
+	}
+	spiVersion = Read_MFRC522(VersionReg);
+	spiErrCount = 0;
+	PRINTF("MFRC522 register W/R test successfully! SPI clock step %d/%d%s\n", best, (int)sizeof(spiDividers) - 1, saved ? " (saved)" : "");
+	return MI_OK;
+}
+
+/*
+ * Function: spi_clock_check
+ * Description: Re-read VersionReg. Once SPI_CARD_ERR_LIMIT card errors came up since the last
+ *              check, also run the register pattern test: an error on the bus shows there, a
+ *              card with a poor RF link does not. Drop back one clock step after SPI_ERR_LIMIT
+ *              failed checks in a row.
+ */
+void spi_clock_check(void)
+{
+	uchar ok = Read_MFRC522(VersionReg) == spiVersion;
+
+	if(ok && cardErrors - spiCardErrors >= SPI_CARD_ERR_LIMIT)
+	{
+		ok = reg_pattern_test() == MI_OK;
+		init_table_write(); // the test overwrote the timer and ModWidthReg
+	}
+	spiCardErrors = cardErrors;
+	if(ok)
+	{
+		spiErrCount = 0;
+		return;
+	}
+	if(++spiErrCount < SPI_ERR_LIMIT)
+		return;
+
+	spiErrCount = 0;
+	if(spiStep > 0)
+	{
+		spi_clock_set(spiStep - 1);
+#if defined(GALILEO) && !defined(LOADGEN)
+		unlink(SPI_CLOCK_FILE); // the next boot sweeps again instead of keeping a step that only ever goes down
+#endif
+		spiDrops++;
+		evlog(EV_SPI_DROP, spiStep, 0, 0);
+	}
+}
+
+void rf_profile_apply(RFProfile *profile)
+{
+	Write_MFRC522(RFCfgReg, profile->rfCfg);
+	Write_MFRC522(RxThresholdReg, profile->rxThreshold);
+	Write_MFRC522(CWGsPReg, profile->cwGsP);
+	Write_MFRC522(ModGsPReg, profile->modGsP);
+}
+
+/* Load the profile saved by rf_tune, keep the reset values if there is none */
+void rf_profile_load(void)
+{
+#ifdef GALILEO
+	unsigned int v[4];
+	FILE *fp = fopen(RF_PROFILE_FILE, "r");
+
+	if(fp == NULL)
+		return;
+	if(fscanf(fp, "%x %x %x %x", &v[0], &v[1], &v[2], &v[3]) == 4)
+	{
+		rfProfile.rfCfg = v[0];
+		rfProfile.rxThreshold = v[1];
+		rfProfile.cwGsP = v[2];
+		rfProfile.modGsP = v[3];
+		printf("RF profile: RFCfg 0x%02X, RxThreshold 0x%02X, CWGsP 0x%02X, ModGsP 0x%02X\n", v[0], v[1], v[2], v[3]);
+	}
+	fclose(fp);
+#endif
+}
+
+#ifdef GALILEO
+void rf_profile_save(void)
+{
+	FILE *fp = fopen(RF_PROFILE_FILE, "w");
+
+	if(fp == NULL)
+	{
+		puts("Save RF profile failed...");
+		return;
+	}
+	fprintf(fp, "%02X %02X %02X %02X\n", rfProfile.rfCfg, rfProfile.rxThreshold, rfProfile.cwGsP, rfProfile.modGsP);
+	fclose(fp);
+}
+
+/*
+ * Function: rf_tune_sweep
+ * Description: Try each value of one profile field against the reference card,
+ *              keep the value with the best success rate, then the shortest round trip
+ * Input parameters:
+ *					field  - profile field to sweep, left at the best value
+ *					values - candidate values
+ *					count  - number of candidate values
+ *					name   - field name for the report
+ * Return value: best success count out of RF_TUNE_ATTEMPTS
+ */
+uchar rf_tune_sweep(uchar *field, const uchar *values, uchar count, const char *name)
+{
+	uchar i, n, ok, bestOk = 0;
+	uchar bestValue = *field;
+	unsigned long t, rtt, bestRtt = 0xFFFFFFFF;
+	uchar str[MAX_LEN];
+
+	for(i = 0; i < count; i++)
+	{
+		*field = values[i];
+		rf_profile_apply(&rfProfile);
+		ok = 0;
+		rtt = 0;
+		for(n = 0; n < RF_TUNE_ATTEMPTS; n++)
+		{
+			t = micros();
+			// REQALL also wakes a halted card
+			if(MFRC522_Request(PICC_REQALL, str) == MI_OK && MFRC522_Anticoll(str) == MI_OK)
+			{
+				ok++;
+				rtt += micros() - t;
+			}
+			MFRC522_Halt(); // a card left READY would take the next REQALL as an error and go IDLE without an answer
+			delay(5);
+		}
+		if(ok)
+			rtt /= ok;
+		printf("%-12s 0x%02X: %2u/%u ok, %lu us\n", name, values[i], ok, RF_TUNE_ATTEMPTS, rtt);
+		if(ok > bestOk || (ok == bestOk && ok != 0 && rtt < bestRtt))
+		{
+			bestOk = ok;
+			bestRtt = rtt;
+			bestValue = values[i];
+		}
+	}
+	*field = bestValue;
+	rf_profile_apply(&rfProfile);
+	return bestOk;
+}
+
+/* Tuning mode: sweep one register at a time against a reference card on the reader, save the best profile */
+void rf_tune(void)
+{
+	const uchar gains[] = {0x08, 0x18, 0x28, 0x38, 0x48, 0x58, 0x68, 0x78};
+	const uchar thresholds[] = {0x44, 0x64, 0x84, 0xA4};
+	const uchar conductances[] = {0x08, 0x10, 0x20, 0x30, 0x3F};
+	uchar ok;
+
+	puts("RF tuning, keep the reference card on the reader...");
+	rf_tune_sweep(&rfProfile.rfCfg, gains, sizeof(gains), "RFCfgReg");
+	rf_tune_sweep(&rfProfile.rxThreshold, thresholds, sizeof(thresholds), "RxThreshold");
+	rf_tune_sweep(&rfProfile.cwGsP, conductances, sizeof(conductances), "CWGsPReg");
+	ok = rf_tune_sweep(&rfProfile.modGsP, conductances, sizeof(conductances), "ModGsPReg");
+	if(ok == 0)
+	{
+		puts("No card response, RF profile not saved.");
+		return;
+	}
+	printf("Best RF profile: RFCfg 0x%02X, RxThreshold 0x%02X, CWGsP 0x%02X, ModGsP 0x%02X, %u/%u ok\n",
+		rfProfile.rfCfg, rfProfile.rxThreshold, rfProfile.cwGsP, rfProfile.modGsP, ok, RF_TUNE_ATTEMPTS);
+	rf_profile_save();
+}
+#endif
+
+/*
+ * Function: card_type_indentify
+ * Description: Look the SAK up in cardTypes[] and load the entry into cardType, keeping the UID length of the selection
+ * Input parameters: sak - select acknowledge of the last cascade level
+ * Return value: MI_OK for a supported card type
+ */
+uchar card_type_indentify(uchar sak)
+{
+	uchar i;
+	uchar uidLen = cardType.uidLen;
+
+	for(i = 0; i < sizeof(cardTypes)/sizeof(cardTypes[0]); i++)
+	{
+		memcpy_P(&cardType, &cardTypes[i], sizeof(cardType));
+		if(cardType.sak == sak)
+		{
+			cardType.uidLen = uidLen;
+			evlog(EV_CARD_TYPE, sak, 1, cardType.family);
+			return MI_OK;
+		}
+	}
+	cardType.uidLen = uidLen;
+	evlog(EV_CARD_TYPE, sak, 0, 0); // Unknown
+	return MI_ERR;
+}
+
+/*
+ * Function: card_select
+ * Description: Anti-collision and selection of the card in the field, going on to cascade level 2
+ *              when the SAK says the UID is not complete. Sets cardType.uidLen.
+ * Input parameters:
+ *					uid - return the card serial number, 4 or 7 bytes
+ *					sak - return the select acknowledge of the last cascade level
+ * Return value: successful return MI_OK
+ */
+uchar card_select(uchar *uid, uchar *sak)
+{
+	uchar str[MAX_LEN];
+	uchar status;
+
+	status = MFRC522_AnticollLevel(PICC_ANTICOLL, str);
+	if(status != MI_OK)
+		return status;
+	memcpy(uid, str, 4);
+	status = MFRC522_SelectLevel(PICC_SElECTTAG, str, sak);
+	cardType.uidLen = 4;
+	if(status == MI_OK && (*sak & 0x04)) // UID not complete, the card goes on to cascade level 2
+	{
+		if(uid[0] != PICC_CASCADE_TAG)
+			return MI_ERR;
+		memmove(uid, uid + 1, 3);
+		status = MFRC522_AnticollLevel(PICC_ANTICOLL2, str);
+		if(status != MI_OK)
+			return status;
+		memcpy(uid + 3, str, 4);
+		status = MFRC522_SelectLevel(PICC_ANTICOLL2, str, sak);
+		cardType.uidLen = 7;
+	}
+	if(status == MI_OK)
+		evlog(EV_SELECT, *sak, 0, 0);
+	return status;
+}
+
+/*
+ * Function: card_auth_state
+ * Description: Open the borrow state record of the selected card, a Classic card authenticates the sector,
+ *              an Ultralight card finds the record pages from its capability container
+ * Input parameters: uid - card serial number
+ * Return value: successful return MI_OK
+ */
+uchar card_auth_state(uchar *uid)
+{
+	uchar key[6]; // sector Key A copied out of flash
+	uchar status;
+
+	if(cardType.family != CARD_CLASSIC)
+		return card_ndef_layout();
+	memcpy_P(key, sectorNewKey[STATE_SECTOR], sizeof(key));
+	status = MFRC522_Auth(PICC_AUTHENT1A, STATE_TRAILER, key, uid + cardType.uidLen - 4); // a 7-byte UID authenticates with its last 4 bytes
+	evlog(EV_AUTH, STATE_TRAILER, status, 0);
+	if(status != MI_OK)
+		status = card_provision(uid); // a new card still has the transport key
+	return status;
+}
+
+/*
+ * Function: card_provision
+ * Description: Give the state sector of a card on the transport key the station keys, the failed
+ *              authentication has put the card back to HALT so it is woken and selected again first
+ * Input parameters: uid - card serial number
+ * Return value: MI_OK with the sector authenticated under the station key
+ */
+uchar card_provision(uchar *uid)
+{
+	uchar key[6];
+	uchar keys[16];
+	uchar status;
+
+	status = card_wake(uid);
+	if(status != MI_OK)
+		return status;
+	uid += cardType.uidLen - 4; // the part of the UID the authentication takes
+	memcpy_P(key, sectorKeyA[STATE_SECTOR], sizeof(key));
+	status = MFRC522_Auth(PICC_AUTHENT1A, STATE_TRAILER, key, uid);
+	if(status == MI_OK)
+	{
+		memcpy_P(keys, sectorNewKey[STATE_SECTOR], sizeof(keys));
+		status = MFRC522_Write(STATE_TRAILER, keys);
+	}
+	if(status == MI_OK)
+		status = MFRC522_Auth(PICC_AUTHENT1A, STATE_TRAILER, keys, uid);
+	evlog(EV_PROVISION, STATE_TRAILER, status, 0);
+	return status;
+}
+
+/*
+ * Function: card_ndef_layout
+ * Description: Put the borrow state record of an Ultralight/NTAG card in the last four pages of its NDEF
+ *              data area, behind the NDEF message. A card without a capability container keeps pages 4-7.
+ * Return value: MI_OK with cardType.stateBlock set, MI_ERR if the NDEF message leaves no room
+ */
+uchar card_ndef_layout(void)
+{
+	uchar str[MAX_LEN];
+	uint size, used;
+	uchar status;
+
+	status = MFRC522_Read(3, str); // page 3: capability container, pages 4-6: start of the data area
+	if(status != MI_OK)
+		return status;
+	if(str[0] != NDEF_MAGIC)
+		return MI_OK; // not NDEF formatted
+	size = str[2] * 8; // data area bytes from page 4
+	if(str[4] == NDEF_TLV && str[5] != 0xFF)
+		used = 2 + str[5] + 1; // NDEF message TLV, then the terminator TLV
+	else if(str[4] == NDEF_TLV)
+		used = 4 + ((str[6] << 8) | str[7]) + 1; // three-byte length format
+	else
+		used = size; // another TLV first, leave the data area alone
+	status = size >= 16 && used <= size - 16 ? MI_OK : MI_ERR;
+	if(status == MI_OK)
+		cardType.stateBlock = 4 + size / 4 - 4;
+	evlog(EV_NDEF_LAYOUT, status == MI_OK ? cardType.stateBlock : 0, size, used);
+	return status;
+}
+
+/* ----------GPIO event function---------- */
+/*
+ * Function: gpio_edge_open
+ * Description: Export a GPIO through sysfs as an input that reports edges to poll()
+ * Input parameters:
+ *					gpio - Linux GPIO number
+ *					edge - "rising", "falling" or "both"
+ * Return value: the opened value file, -1 if edge events are not available
+ */
+int gpio_edge_open(int gpio, const char *edge)
+{
+#if defined(GALILEO) && !defined(HOST)
+	char path[64];
+	char buf[8];
+	int fd;
+	FILE *fp;
+
+	fp = fopen("/sys/class/gpio/export", "w");
+	if(fp != NULL)
+	{
+		fprintf(fp, "%d", gpio); // fails harmlessly when already exported
+		fclose(fp);
+	}
+	sprintf(path, "/sys/class/gpio/gpio%d/edge", gpio);
+	fp = fopen(path, "w");
+	if(fp == NULL)
+		return -1;
+	fputs(edge, fp);
+	if(fclose(fp) != 0)
+		return -1;
+
+	sprintf(path, "/sys/class/gpio/gpio%d/value", gpio);
+	fd = open(path, O_RDONLY);
+	if(fd >= 0 && read(fd, buf, sizeof(buf)) < 0) // the first read clears the pending event
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * Function: gpio_edge_wait
+ * Description: Sleep until one of the value files reports an edge, then re-arm them
+ * Input parameters:
+ *					fds       - value files from gpio_edge_open, negative entries are ignored
+ *					count     - number of files
+ *					timeoutMs - maximum sleep, 0 only collects pending edges
+ * Return value: number of files with an edge, 0 on timeout
+ */
+int gpio_edge_wait(int *fds, int count, int timeoutMs)
+{
+#ifdef GALILEO
+	struct pollfd pfd[2];
+	char buf[8];
+	int i, n;
+
+	if(count > 2)
+		count = 2;
+	for(i = 0; i < count; i++)
+	{
+		pfd[i].fd = fds[i];
+		pfd[i].events = POLLPRI | POLLERR;
+		pfd[i].revents = 0;
+	}
+	n = poll(pfd, count, timeoutMs);
+	if(n <= 0)
+		return 0;
+	for(i = 0; i < count; i++)
+	{
+		if(pfd[i].revents)
+		{
+			lseek(pfd[i].fd, 0, SEEK_SET);
+			if(read(pfd[i].fd, buf, sizeof(buf)) < 0) // not re-armed, the next poll() returns at once
+				n--;
+		}
+	}
+	return n;
+#else
+	return 0;
+#endif
+}
+
+/* Sleep until a slot sensor changes or timeoutMs passes, return 1 if a slot changed */
+int station_wait(int timeoutMs)
+{
+	int changed = 0;
+
+	if(traceMode == TRACE_REPLAY)
+		;
+	else if(ublFd[0] < 0 && ublFd[1] < 0)
+		delay(timeoutMs);
+	else
+		changed = gpio_edge_wait(ublFd, 2, timeoutMs) > 0;
+	if(trace_value(TR_WAKE, 0, changed))
+	{
+		evlog(EV_SLOT_CHANGE, slot_read(ubl_1) + slot_read(ubl_2), 0, 0);
+		return 1;
+	}
+	return 0;
+}
+
+/* Sleep until the MFRC522 IRQ pin asserts, return 0 on timeout, -1 if the IRQ pin is not used */
+int irq_wait(int timeoutMs)
+{
+	if(traceMode == TRACE_REPLAY)
+		return trace_peek(TR_IRQ) ? trace_value(TR_IRQ, 0, 0) : -1;
+	if(irqFd < 0)
+		return -1;
+	return trace_value(TR_IRQ, 0, gpio_edge_wait(&irqFd, 1, timeoutMs));
+}
+
+int slot_read(int pin)
+{
+	return trace_value(TR_PIN, pin, digitalRead(pin));
+}
+
+/* ----------SPI trace function---------- */
+#ifdef GALILEO
+FILE *traceFile = NULL;
+TraceRecord traceNext; // replay: the record the driver has to match next
+int traceHaveNext = 0;
+unsigned long traceIndex = 0; // records captured or replayed
+unsigned long traceCount[TR_TYPES] = {0};
+uint32_t traceFirstUs = 0;
+const char *traceTypeName[TR_TYPES] = {"read", "write", "pin", "irq", "wake", "status", "time"};
+
+/*
+ * Function: trace_open
+ * Description: Start capturing into a new trace file or replaying an existing one
+ * Input parameters:
+ *					path - trace file
+ *					mode - TRACE_CAPTURE or TRACE_REPLAY
+ * Return value: successful return MI_OK
+ */
+uchar trace_open(const char *path, uchar mode)
+{
+	uint32_t header[2];
+
+	traceFile = fopen(path, mode == TRACE_CAPTURE ? "wb" : "rb");
+	if(traceFile == NULL)
+	{
+		printf("Open SPI trace %s failed...\n", path);
+		return MI_ERR;
+	}
+	setvbuf(traceFile, NULL, _IOFBF, 64 * 1024);
+	if(mode == TRACE_CAPTURE)
+	{
+		header[0] = TRACE_MAGIC;
+		header[1] = (TRACE_VERSION << 16) | sizeof(TraceRecord);
+		fwrite(header, sizeof(header), 1, traceFile);
+	}
+	else
+	{
+		if(fread(header, sizeof(header), 1, traceFile) != 1 || header[0] != TRACE_MAGIC
+			|| header[1] != ((TRACE_VERSION << 16) | sizeof(TraceRecord)))
+		{
+			printf("%s is not an SPI trace\n", path);
+			fclose(traceFile);
+			return MI_ERR;
+		}
+		traceHaveNext = fread(&traceNext, sizeof(traceNext), 1, traceFile) == 1;
+		traceFirstUs = traceNext.us;
+	}
+	traceMode = mode;
+	return MI_OK;
+}
+
+/*
+ * Function: trace_value
+ * Description: Pass one register access or input through the trace
+ * Input parameters:
+ *					type - TR_* record type
+ *					addr - register address or pin
+ *					val  - value seen on the hardware (ignored when replaying reads)
+ * Return value: val, or the recorded value when replaying
+ */
+int trace_value(uchar type, uchar addr, int val)
+{
+	TraceRecord r;
+
+	if(traceMode == TRACE_OFF)
+		return val;
+	traceCount[type]++;
+	if(traceMode == TRACE_CAPTURE)
+	{
+		r.us = micros();
+		if(traceIndex++ == 0)
+			traceFirstUs = r.us;
+		r.type = type;
+		r.addr = addr;
+		r.val = val;
+		fwrite(&r, sizeof(r), 1, traceFile);
+		return val;
+	}
+
+	if(!traceHaveNext)
+		trace_end();
+	if(traceNext.type != type || traceNext.addr != addr || (type == TR_WRITE && traceNext.val != val))
+	{
+		printf("Replay diverged at record %lu: trace has %s 0x%02X = 0x%02X, driver did %s 0x%02X",
+			traceIndex, traceTypeName[traceNext.type], traceNext.addr, traceNext.val & 0xFFFF, traceTypeName[type], addr);
+		if(type == TR_WRITE)
+			printf(" = 0x%02X", val);
+		putchar('\n');
+		exit(2);
+	}
+#ifdef HOST
+	host_clock_set(traceNext.us);
+#endif
+	val = traceNext.val;
+	traceIndex++;
+	traceHaveNext = fread(&traceNext, sizeof(traceNext), 1, traceFile) == 1;
+	return val;
+}
+
+/* Replay: whether the next record is of this type */
+int trace_peek(uchar type)
+{
+	return traceMode == TRACE_REPLAY && traceHaveNext && traceNext.type == type;
+}
+
+/* Capture: push the buffered records to the file, called once the card session is over */
+void trace_flush(void)
+{
+	if(traceMode == TRACE_CAPTURE)
+		fflush(traceFile);
+}
+
+/* Replay: the recording is used up, report and stop */
+void trace_end(void)
+{
+	uchar t;
+
+	printf("Replay complete: %lu records over %lu ms of station time\n", traceIndex, (unsigned long)((uint32_t)micros() - traceFirstUs) / 1000);
+	for(t = 0; t < TR_TYPES; t++)
+		printf("  %-6s %lu\n", traceTypeName[t], traceCount[t]);
+	fclose(traceFile);
+	exit(0);
+}
+#endif
+
+/* ----------Event log function---------- */
+#if defined(GALILEO) && !defined(LOADGEN)
+EvRing *evlogRing = NULL; // mapped EVLOG_FILE, NULL if the log is not available
+
+/* Map the ring buffer file, create it on the first boot */
+void evlog_open(void)
+{
+	int fd;
+	void *p;
+
+	fd = open(EVLOG_FILE, O_RDWR | O_CREAT, 0644);
+	if(fd < 0 || ftruncate(fd, sizeof(EvRing)) != 0)
+	{
+		puts("Open event log failed...");
+		return;
+	}
+	p = mmap(NULL, sizeof(EvRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED)
+	{
+		puts("Map event log failed...");
+		return;
+	}
+	evlogRing = (EvRing *)p;
+	if(evlogRing->magic == EVLOG_MAGIC && evlogRing->version != EVLOG_VERSION && rename(EVLOG_FILE, EVLOG_OLD_FILE) == 0)
+	{
+		// A log of another build is kept for evlog_decode instead of being overwritten
+		printf("Event log version %u moved to %s\n", evlogRing->version, EVLOG_OLD_FILE);
+		munmap(p, sizeof(EvRing));
+		evlogRing = NULL;
+		evlog_open();
+		return;
+	}
+	if(evlogRing->magic != EVLOG_MAGIC || evlogRing->version != EVLOG_VERSION || evlogRing->capacity != EVLOG_CAPACITY)
+	{
+		evlogRing->magic = EVLOG_MAGIC;
+		evlogRing->version = EVLOG_VERSION;
+		evlogRing->recordSize = sizeof(EvRecord);
+		evlogRing->capacity = EVLOG_CAPACITY;
+		evlogRing->head = 0;
+	}
+	evlog(EV_BOOT, 0, (int32_t)time(NULL), 0);
+}
+
+/*
+ * Function: evlog
+ * Description: Append one record to the ring buffer, nothing is formatted here,
+ *              run evlog_decode on EVLOG_FILE to read the log
+ * Input parameters:
+ *					id      - EV_* event
+ *					a, b, c - raw event arguments, see EVLOG_EVENTS in evlog.h
+ */
+void evlog(uint16_t id, uint16_t a, int32_t b, int32_t c)
+{
+	EvRecord e;
+
+	if(evlogRing == NULL)
+		return;
+	e.ms = millis();
+	e.id = id;
+	e.a = a;
+	e.b = b;
+	e.c = c;
+	if(rtActive) // no page of the log file is touched at real-time priority
+	{
+		if(rtEventCount < RT_EVENTS)
+			rtEvents[rtEventCount++] = e;
+		return;
+	}
+	evlog_put(&e);
+}
+
+/* Store one record in the ring */
+void evlog_put(const EvRecord *e)
+{
+	evlogRing->records[evlogRing->head & (EVLOG_CAPACITY - 1)] = *e;
+	__atomic_store_n(&evlogRing->head, evlogRing->head + 1, __ATOMIC_RELEASE); // publish the record after it is complete, a 64-bit store on the 32-bit Quark
+}
+
+/* Move the events held back during the real-time section into the ring */
+void evlog_release(void)
+{
+	uchar i;
+
+	for(i = 0; i < rtEventCount; i++)
+		evlog_put(&rtEvents[i]);
+	rtEventCount = 0;
+}
+#endif
+
+/* ----------Real-time function---------- */
+/*
+ * Function: rt_init
+ * Description: Lock memory, prefault the stack and pin the reader to RT_CPU for real-time mode
+ * Input parameters: priority - SCHED_FIFO priority used by rt_enter
+ */
+void rt_init(int priority)
+{
+#ifdef GALILEO
+	volatile char stack[RT_STACK_PREFAULT];
+	cpu_set_t cpus;
+	struct sched_param param;
+	int lo = sched_get_priority_min(SCHED_FIFO), hi = sched_get_priority_max(SCHED_FIFO);
+
+	if(priority < lo || priority > hi)
+	{
+		printf("Real-time priority %d out of range %d-%d\n", priority, lo, hi);
+		priority = priority < lo ? lo : hi;
+	}
+	param.sched_priority = priority;
+	if(sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &param) != 0)
+	{
+		printf("SCHED_FIFO failed (%s), real-time mode off\n", strerror(errno));
+		return;
+	}
+	param.sched_priority = 0;
+	sched_setscheduler(0, SCHED_OTHER, &param);
+
+	if(mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+		puts("mlockall failed, real-time mode may page fault");
+	memset((char *)stack, 0, sizeof(stack));
+
+	CPU_ZERO(&cpus);
+	CPU_SET(RT_CPU, &cpus);
+	if(sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+		puts("Pin reader CPU failed...");
+
+	rtPriority = priority;
+	printf("Real-time mode: SCHED_FIFO priority %d on CPU %d\n", rtPriority, RT_CPU);
+#endif
+}
+
+/* Raise the reader to SCHED_FIFO, a forked child starts back at normal priority */
+void rt_enter(void)
+{
+#ifdef GALILEO
+	struct sched_param param;
+
+	if(rtPriority == 0)
+		return;
+	param.sched_priority = rtPriority;
+	if(sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &param) != 0)
+	{
+		printf("SCHED_FIFO failed (%s), real-time mode off\n", strerror(errno));
+		rtPriority = 0;
+		return;
+	}
+	rtActive = 1;
+#endif
+}
+
+/* Back to normal priority for network, logging and the actuator, then write out what the real-time section held back */
+void rt_leave(void)
+{
+#ifdef GALILEO
+	struct sched_param param;
+
+	if(!rtActive)
+		return;
+	param.sched_priority = 0;
+	sched_setscheduler(0, SCHED_OTHER, &param);
+	rtActive = 0;
+	evlog_release();
+	trace_flush(); // the capture buffer is never written out at real-time priority
+#endif
+}
+
+void jitter_add(JitterStat *stat, unsigned long elapsed, unsigned long deadline)
+{
+	unsigned long late = 0;
+
+	if(elapsed > deadline)
+	{
+		late = elapsed - deadline;
+		stat->misses++;
+	}
+	stat->count++;
+	stat->sum += late;
+	if(late > stat->max)
+		stat->max = late;
+}
+
+#ifdef GALILEO
+/* Print and reset the statistics */
+void jitter_report(JitterStat *stat, const char *name)
+{
+	if(stat->count != 0)
+	{
+		printf("%s: %lu samples, %lu late, lateness avg %lu us, max %lu us\n",
+			name, stat->count, stat->misses, stat->sum / stat->count, stat->max);
+	}
+	memset(stat, 0, sizeof(JitterStat));
+}
+#endif
+
+/* ----------Boot function---------- */
+/* Print the time since the start of setup() after a boot stage */
+void boot_stage(const char *name)
+{
+	PRINTF("Boot: %s ready after %lu ms\n", name, (micros() - bootStart) / 1000);
+}
+
+/*
+ * Function: boot_reader
+ * Description: Reset the MFRC522, calibrate the SPI clock and initialize the reader. A failed
+ *              attempt pulls NRSTPD low for a hard reset and starts over, the pause doubles
+ *              from BOOT_RETRY_MIN_MS up to BOOT_RETRY_MAX_MS. There is no way on without a reader.
+ */
+void boot_reader(void)
+{
+	unsigned long pause = BOOT_RETRY_MIN_MS;
+
+	while(1)
+	{
+		bootTries++;
+		if(MFRC522_Reset() != MI_OK)
+			PUTS("MFRC522 reset timed out...");
+		else if(spi_clock_calibrate() != MI_OK) // MFRC522 Register W/R Test, raise the SPI clock until the test fails
+			PUTS("MFRC522 register W/R test failed...");
+		else
+		{
+			PUTS("MFRC522 Initialization...");
+			if(MFRC522_Init() == MI_OK)
+				return;
+			PUTS("MFRC522 Initialization failed...");
+		}
+		digitalWrite(NRSTPD, LOW);
+		delay(pause);
+		digitalWrite(NRSTPD, HIGH);
+		pause = pause * 2 > BOOT_RETRY_MAX_MS ? BOOT_RETRY_MAX_MS : pause * 2;
+	}
+}
+
+/* The first card poll is due, take the boot time */
+void boot_ready(void)
+{
+	bootPollUs = micros() - bootStart;
+	if(bootPollUs == 0)
+		bootPollUs = 1;
+	evlog(EV_BOOT_READY, bootTries, bootPollUs / 1000, 0);
+	PRINTF("Boot: first card poll after %lu ms, reader attempts %u\n", bootPollUs / 1000, bootTries);
+}
+
+/* ----------L298 function---------- */
+void L298_init()
+{
+	pinMode(ENA, OUTPUT);
+	pinMode(IN1, OUTPUT);
+	pinMode(IN2, OUTPUT);
+	digitalWrite(ENA, LOW);
+	digitalWrite(IN1, HIGH);
+	digitalWrite(IN2, HIGH);
+}
+
+void forward(double time)
+{
+	delay(500);
+	digitalWrite(ENA, HIGH);
+	digitalWrite(IN2, LOW);
+	delay(1000*time);
+	digitalWrite(IN2, HIGH);
+	slow_stop();
+	total_time = total_time + time;
+	unlockCount++;
+	
+}
+
+void reversal(double time)
+{
+	delay(500);
+	digitalWrite(ENA, HIGH);
+	digitalWrite(IN1, LOW);
+	delay(950*time);
+	digitalWrite(IN1, HIGH);
+	slow_stop();
+	total_time = total_time - time;
+	
 }
 
 void slow_stop()
 {
-	digitalWrite(ENA, LOW);
+	digitalWrite(ENA, LOW);
+}
+
+void reset_motor()
+{
+	if(total_time > 0)
+	{
+		reversal(total_time);
+	}
+	else if(total_time < 0)
+	{
+		forward(total_time*(-1));
+	}
+	else
+	{}	// total_time = 0, do nothing
+}
+
+/* ----------Card state function---------- */
+#define SIP_ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND \
+	do { \
+		v0 += v1; v1 = SIP_ROTL(v1, 13); v1 ^= v0; v0 = SIP_ROTL(v0, 32); \
+		v2 += v3; v3 = SIP_ROTL(v3, 16); v3 ^= v2; \
+		v0 += v3; v3 = SIP_ROTL(v3, 21); v3 ^= v0; \
+		v2 += v1; v1 = SIP_ROTL(v1, 17); v1 ^= v2; v2 = SIP_ROTL(v2, 32); \
+	} while(0)
+
+/*
+ * Function: siphash24
+ * Description: SipHash-2-4 of a short message
+ * Input parameters:
+ *					key - 16-byte key
+ *					in  - message
+ *					len - message length
+ * Return value: 64-bit tag
+ */
+uint64_t siphash24(const uchar *key, const uchar *in, uchar len)
+{
+	uint64_t k0 = 0, k1 = 0, m, b;
+	uint64_t v0, v1, v2, v3;
+	uchar i, j, end = len & ~7;
+
+	for(i = 0; i < 8; i++)
+	{
+		k0 |= (uint64_t)key[i] << (8 * i);
+		k1 |= (uint64_t)key[i + 8] << (8 * i);
+	}
+	v0 = 0x736f6d6570736575ULL ^ k0;
+	v1 = 0x646f72616e646f6dULL ^ k1;
+	v2 = 0x6c7967656e657261ULL ^ k0;
+	v3 = 0x7465646279746573ULL ^ k1;
+
+	for(i = 0; i < end; i += 8)
+	{
+		m = 0;
+		for(j = 0; j < 8; j++)
+			m |= (uint64_t)in[i + j] << (8 * j);
+		v3 ^= m;
+		SIP_ROUND;
+		SIP_ROUND;
+		v0 ^= m;
+	}
+	b = (uint64_t)len << 56;
+	for(j = 0; j < (len & 7); j++)
+		b |= (uint64_t)in[end + j] << (8 * j);
+	v3 ^= b;
+	SIP_ROUND;
+	SIP_ROUND;
+	v0 ^= b;
+	v2 ^= 0xff;
+	SIP_ROUND;
+	SIP_ROUND;
+	SIP_ROUND;
+	SIP_ROUND;
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/* MAC of a card record, binds the record to the card serial number so it cannot be copied to another card */
+uint32_t card_state_mac(const uchar *record, const uchar *uid)
+{
+	uchar key[16];
+	uchar msg[7 + STATE_MAC_OFFSET];
+
+	memcpy_P(key, stateMacKey, sizeof(key));
+	memcpy(msg, uid, cardType.uidLen);
+	memcpy(msg + cardType.uidLen, record, STATE_MAC_OFFSET);
+	return (uint32_t)siphash24(key, msg, cardType.uidLen + STATE_MAC_OFFSET);
+}
+
+/*
+ * Function: card_state_verify
+ * Description: Check a borrow state record read from the card
+ * Input parameters:
+ *					record - 16-byte block data
+ *					serNum - card serial number
+ *					seq    - returns the record sequence number, 0 if the record is not valid
+ * Return value: CARD_CAN_BORROW, CARD_CAN_RETURN or CARD_PENDING, -1 if there is no valid record
+ */
+int card_state_verify(const uchar *record, const uchar *uid, uint *seq)
+{
+	uint32_t mac;
+
+	*seq = 0;
+	if(record[0] != STATE_MAGIC || record[1] > CARD_PENDING)
+		return -1;
+	mac = ((uint32_t)record[12] << 24) | ((uint32_t)record[13] << 16) | ((uint32_t)record[14] << 8) | record[15];
+	if(mac != card_state_mac(record, uid))
+		return -1;
+	*seq = (record[8] << 8) | record[9];
+	return record[1];
+}
+
+/*
+ * Function: card_state_write
+ * Description: Write a signed borrow state record to the card, a Classic sector has to be authenticated
+ * Input parameters:
+ *					state  - CARD_CAN_BORROW, CARD_CAN_RETURN or CARD_PENDING
+ *					seq    - sequence number of the new record
+ *					serNum - card serial number
+ * Return value: successful return MI_OK
+ */
+uchar card_state_write(uchar state, uint seq, const uchar *uid)
+{
+	uchar record[16];
+	uint32_t stamp = station_time();
+	uint32_t mac;
+	uchar status;
+	uchar i;
+
+	memset(record, 0, sizeof(record));
+	record[0] = STATE_MAGIC;
+	record[1] = state;
+	record[2] = stationId >> 8;
+	record[3] = stationId & 0xFF;
+	record[4] = stamp >> 24;
+	record[5] = stamp >> 16;
+	record[6] = stamp >> 8;
+	record[7] = stamp;
+	record[8] = seq >> 8;
+	record[9] = seq;
+	mac = card_state_mac(record, uid);
+	record[12] = mac >> 24;
+	record[13] = mac >> 16;
+	record[14] = mac >> 8;
+	record[15] = mac;
+	if(cardType.family == CARD_CLASSIC)
+		status = MFRC522_Write(cardType.stateBlock, record);
+	else
+	{
+		// four pages, the MAC page last so a torn write leaves a record that does not verify
+		for(i = 0, status = MI_OK; i < 4 && status == MI_OK; i++)
+			status = MFRC522_WritePage(cardType.stateBlock + i, record + 4 * i);
+	}
+	evlog(EV_CARD_STATE_WRITE, state, seq, status);
+	return status;
+}
+
+/* Give back the borrow charged to the quota block before the slot opened */
+uchar card_quota_refund(long *quota)
+{
+	uchar status;
+
+	status = MFRC522_Increment(QUOTA_BLOCK, 1);
+	if(status == MI_OK)
+		status = MFRC522_Transfer(QUOTA_BLOCK);
+	if(status == MI_OK)
+		(*quota)++;
+	evlog(EV_QUOTA, 0, *quota, status);
+	return status;
+}
+
+/*
+ * Function: card_wake
+ * Description: Wake the halted card again and select it
+ * Input parameters:
+ *					uid - card serial number of the session, another card is refused
+ * Return value: successful return MI_OK
+ */
+uchar card_wake(const uchar *uid)
+{
+	uchar str[MAX_LEN];
+	uchar again[7];
+	uchar status, sak;
+	uchar uidLen = cardType.uidLen;
+
+	status = MFRC522_Request(PICC_REQALL, str); // REQALL also wakes cards in HALT state
+	if(status == MI_OK)
+		status = card_select(again, &sak);
+	if(status != MI_OK || cardType.uidLen != uidLen || memcmp(again, uid, uidLen) != 0)
+	{
+		cardType.uidLen = uidLen;
+		return MI_ERR;
+	}
+	return MI_OK;
+}
+
+/* Wake the halted card again and open its borrow state record */
+uchar card_reselect(uchar *uid)
+{
+	if(card_wake(uid) != MI_OK)
+		return MI_ERR;
+	return card_auth_state(uid);
+}
+
+/* Time stamp of the card record, taken through the SPI trace so a replay writes the same bytes */
+uint32_t station_time(void)
+{
+	uint32_t t;
+
+#ifdef GALILEO
+	t = time(NULL);
+#else
+	t = millis() / 1000;
+#endif
+	t = ((uint32_t)(uint16_t)trace_value(TR_TIME, 1, (int)(t >> 16)) << 16) | (uint16_t)trace_value(TR_TIME, 0, (int)(t & 0xFFFF));
+	return t;
+}
+
+/* ----------Card session function---------- */
+/*
+ * Function: session_begin
+ * Description: Start the session of the card just served, once it has reached a decision
+ * Input parameters: uid - card serial number, cardType.uidLen bytes
+ */
+void session_begin(const uchar *uid)
+{
+	if(cardType.uidLen == 4)
+		memcpy(session.uid, uid, 4);
+	else
+	{
+		session.uid[0] = PICC_CASCADE_TAG;
+		memcpy(session.uid + 1, uid, 3);
+	}
+	session.active = 1;
+	session.held = 0;
+	session.lastSeen = millis();
+}
+
+/* Whether the card of the session has been away for sessionWindow, taken through the SPI trace so a replay decides the same */
+uchar session_expired(void)
+{
+	return trace_value(TR_STATUS, 1, millis() - session.lastSeen >= sessionWindow);
+}
+
+/*
+ * Function: session_held
+ * Description: After a WUPA answer, check whether the card in the field is the one of the session.
+ *              It is put back to HALT at once, the cascade level 1 anticollision is all it costs.
+ * Return value: 1 if nothing has to run for the card, 0 if it starts a new session
+ */
+uchar session_held(void)
+{
+	uchar str[MAX_LEN];
+	uchar status;
+
+	status = MFRC522_Anticoll(str);
+	if(status == MI_OK && memcmp(str, session.uid, 4) != 0)
+	{
+		session.active = 0; // another card, it stays in READY state for card_select
+		return 0;
+	}
+	if(status != MI_OK && session_expired()) // no clean answer, more than one card in the field
+	{
+		session.active = 0;
+		return 0;
+	}
+	if(!session.held) // once when the hold starts, not at every poll
+		evlog(EV_CARD_HELD, status, millis() - session.lastSeen, 0);
+	session.held = 1;
+	if(status == MI_OK)
+		session.lastSeen = millis();
+	MFRC522_Halt();
+	return 1;
+}
+
+/* ----------Bus budget function---------- */
+#ifdef HOST
+/*
+ * Function: spi_budget_check
+ * Description: Run each public driver operation once against the emulated MFRC522
+ *              and compare its bus traffic with busBudget[]
+ * Return value: 0 if every operation succeeds within its budget, 1 otherwise
+ */
+int spi_budget_check(void)
+{
+	uchar str[MAX_LEN];
+	uchar key[6];
+	uchar data[16];
+	uchar op, sak, status = MI_OK;
+	uint seq;
+	int failed = 0;
+	HostBusStats before, after;
+	unsigned long transfers, chipSelects, polls;
+
+	memset(data, 0x5A, sizeof(data));
+	memcpy_P(key, sectorKeyA[1], sizeof(key)); // the emulated card is still on the transport key
+	printf("%-20s %10s %10s %10s\n", "Operation", "transfers", "selects", "polls");
+	for(op = 0; op < sizeof(busBudget)/sizeof(busBudget[0]); op++)
+	{
+		host_bus_stats(&before);
+		switch(op)
+		{
+			case 0: status = MFRC522_Request(PICC_REQIDL, str); break;
+			case 1: status = MFRC522_Anticoll(str); memcpy(serNum, str, 5); break;
+			case 2: status = MFRC522_SelectTag(serNum) != 0 ? MI_OK : MI_ERR; break;
+			case 3: status = MFRC522_Auth(PICC_AUTHENT1A, 7, key, serNum); break;
+			case 4: status = MFRC522_Read(4, str); break;
+			case 5: status = MFRC522_Write(5, data); break;
+			case 6: status = MFRC522_ValueFormat(6, 10); break;
+			case 7: status = MFRC522_Decrement(6, 1); break;
+			case 8: status = MFRC522_Transfer(6); break;
+			case 9: MFRC522_Halt(); status = MI_OK; break;
+			case 10: host_card_type(HOST_CARD_ULTRALIGHT); status = MFRC522_Request(PICC_REQIDL, str); break;
+			case 11: status = card_select(serNum, &sak); if(status == MI_OK) status = card_type_indentify(sak); break;
+			case 12: status = card_ndef_layout(); break;
+			case 13: status = card_state_write(CARD_CAN_RETURN, 1, serNum); break;
+		}
+		host_bus_stats(&after);
+		transfers = after.transfers - before.transfers;
+		chipSelects = after.chipSelects - before.chipSelects;
+		polls = after.polls - before.polls;
+		printf("%-20s %4lu / %-4lu %4lu / %-4lu %4lu / %-4lu", busBudget[op].name,
+			transfers, busBudget[op].transfers, chipSelects, busBudget[op].chipSelects, polls, busBudget[op].polls);
+		if(status != MI_OK)
+		{
+			printf("  failed, status %u", status);
+			failed = 1;
+		}
+		else if(transfers > busBudget[op].transfers || chipSelects > busBudget[op].chipSelects || polls > busBudget[op].polls)
+		{
+			printf("  over budget");
+			failed = 1;
+		}
+		putchar('\n');
+	}
+	
+	// The Ultralight record reads back from the end of the NDEF data area, the empty NDEF message in page 4 is untouched
+	status = MFRC522_Read(cardType.stateBlock, str);
+	if(status != MI_OK || cardType.stateBlock != 36 || card_state_verify(str, serNum, &seq) != CARD_CAN_RETURN || seq != 1)
+	{
+		printf("Ultralight card record at page %u does not read back\n", cardType.stateBlock);
+		failed = 1;
+	}
+	else if(MFRC522_Read(4, str) != MI_OK || str[0] != NDEF_TLV || str[1] != 0 || str[2] != 0xFE)
+	{
+		printf("Ultralight NDEF message overwritten\n");
+		failed = 1;
+	}
+
+	// A Classic card with a 7-byte UID answers with the ATQA of an Ultralight, its SAK tells them apart
+	host_card_type(HOST_CARD_CLASSIC_1K_7);
+	status = MFRC522_Request(PICC_REQIDL, str);
+	if(status == MI_OK)
+		status = card_select(serNum, &sak);
+	if(status == MI_OK)
+		status = card_type_indentify(sak);
+	if(status != MI_OK || cardType.family != CARD_CLASSIC || cardType.uidLen != 7 || card_auth_state(serNum) != MI_OK)
+	{
+		printf("Classic card with a 7-byte UID not served as a Classic card\n");
+		failed = 1;
+	}
+	return failed;
+}
+#endif
+
+/* ----------Database function---------- */
+#ifndef NODE
+/*
+ * Server requests run curl, one process per request, the way the station has always talked to the
+ * server. Paths and form bodies are streamed piece by piece into one static buffer instead of
+ * being assembled in stack buffers. The load generator links its own client below.
+ */
+STATION_LOCAL char request[REQUEST_MAX];
+STATION_LOCAL uint requestLen = 0;
+#ifdef LOADGEN
+STATION_LOCAL int httpFd = -1; // server connection, -1 when closed
+STATION_LOCAL uchar httpPending = 0; // httpFd is still connecting, started by http_connect_start
+STATION_LOCAL uint32_t recordSeq = 0; // records uploaded, sent as X-Record-Id so standin can count repeats
+STATION_LOCAL uint32_t recordBoot = 0; // unix time of the first record, keeps X-Record-Id unique across runs
+#endif
+
+void request_begin(void)
+{
+	requestLen = 0;
+	request[0] = '\0';
+}
+
+/* Append a PSTR() string */
+void request_P(const char *s)
+{
+	requestLen += snprintf(request + requestLen, REQUEST_MAX - requestLen, "%s", s);
+	if(requestLen >= REQUEST_MAX)
+		requestLen = REQUEST_MAX - 1;
+}
+
+void request_long(long v)
+{
+	requestLen += snprintf(request + requestLen, REQUEST_MAX - requestLen, "%ld", v);
+	if(requestLen >= REQUEST_MAX)
+		requestLen = REQUEST_MAX - 1;
+}
+
+#ifdef LOADGEN
+/*
+ * The load generator runs hundreds of stations in one process, a curl process per request would
+ * measure fork() instead of the server. Each of its stations keeps one HTTP/1.1 connection.
+ */
+/* Open a TCP connection to the server, return the socket or -1. Without wait the socket is left non-blocking and connecting. */
+int http_connect(const char *ip, const char *port, uchar wait)
+{
+	struct addrinfo hints, *res, *ai;
+	struct timeval tv;
+	int fd = -1, one = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(ip, port, &hints, &res) != 0)
+		return -1;
+	tv.tv_sec = HTTP_TIMEOUT_MS / 1000;
+	tv.tv_usec = (HTTP_TIMEOUT_MS % 1000) * 1000;
+	for(ai = res; ai != NULL; ai = ai->ai_next)
+	{
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if(fd < 0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)); // also bounds connect()
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if(!wait)
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		if(connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 || (!wait && errno == EINPROGRESS))
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+/* Start connecting to the server at boot, the first request finishes the connection */
+void http_connect_start(const char *ip, const char *port)
+{
+	if(httpFd >= 0 || traceMode == TRACE_REPLAY)
+		return;
+	httpFd = http_connect(ip, port, 0);
+	httpPending = httpFd >= 0;
+}
+
+/* Wait for the connection started by http_connect_start, then make it blocking again. Return 0 or -1 */
+int http_connect_finish(void)
+{
+	struct pollfd pfd;
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	httpPending = 0;
+	pfd.fd = httpFd;
+	pfd.events = POLLOUT;
+	if(poll(&pfd, 1, HTTP_TIMEOUT_MS) != 1 || getsockopt(httpFd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0)
+		return -1;
+	fcntl(httpFd, F_SETFL, fcntl(httpFd, F_GETFL) & ~O_NONBLOCK);
+	return 0;
+}
+
+/*
+ * Function: http_request
+ * Description: Load generator: send one request over the kept-alive connection of the station
+ *              and read the answer. A connection the server has closed meanwhile is opened again once.
+ * Input parameters:
+ *					ip, port - server address
+ *					method   - "GET" or "POST"
+ *					path     - request path
+ *					headers  - extra header lines, each ending in "\r\n"
+ *					body     - form body of a POST, NULL for none
+ *					response - buffer for the answer body, always terminated
+ *					size     - size of the buffer
+ * Return value: HTTP status code, -1 if the server did not answer
+ */
+int http_request(const char *ip, const char *port, const char *method, const char *path, const char *headers, const char *body, char *response, int size)
+{
+	char out[REQUEST_MAX + 256];
+	char in[HTTP_RESPONSE_MAX + 1];
+	char *end, *p;
+	int attempt, len, got, n = 0, head, contentLength, keep, code = -1;
+	struct timespec start, now;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	response[0] = '\0';
+	len = snprintf(out, sizeof(out), "%s %s HTTP/1.1\r\nHost: %s:%s\r\n%s", method, path, ip, port, headers);
+	if(body != NULL)
+		len += snprintf(out + len, sizeof(out) - len, "Content-Type: application/x-www-form-urlencoded\r\nContent-Length: %d\r\n\r\n%s", (int)strlen(body), body);
+	else
+		len += snprintf(out + len, sizeof(out) - len, "\r\n");
+
+	for(attempt = 0; attempt < 2 && code < 0; attempt++)
+	{
+		if(httpPending && http_connect_finish() != 0)
+		{
+			close(httpFd);
+			httpFd = -1;
+		}
+		if(httpFd < 0)
+		{
+			attempt++; // a fresh connection gets no second chance
+			httpFd = http_connect(ip, port, 1);
+			if(httpFd < 0)
+				break;
+		}
+		if(send(httpFd, out, len, MSG_NOSIGNAL) != len)
+		{
+			close(httpFd);
+			httpFd = -1;
+			continue;
+		}
+
+		// Status line and headers, then Content-Length bytes of body or everything up to the close
+		got = 0;
+		head = -1;
+		contentLength = -1;
+		while(1)
+		{
+			if(head >= 0 && contentLength >= 0 && got >= head + contentLength)
+				break;
+			if(got >= HTTP_RESPONSE_MAX)
+				break;
+			n = recv(httpFd, in + got, HTTP_RESPONSE_MAX - got, 0);
+			if(n <= 0)
+				break;
+			got += n;
+			in[got] = '\0';
+			if(head < 0 && (end = strstr(in, "\r\n\r\n")) != NULL)
+			{
+				head = end + 4 - in;
+				p = strcasestr(in, "\r\nContent-Length:");
+				if(p != NULL && p < end)
+					contentLength = atoi(p + 17);
+			}
+		}
+		keep = head >= 0 && contentLength >= 0 && got == head + contentLength;
+		if(head >= 0 && (keep || n == 0) && sscanf(in, "HTTP/%*d.%*d %d", &code) == 1)
+		{
+			in[got] = '\0';
+			snprintf(response, size, "%s", in + head);
+			p = strcasestr(in, "\r\nConnection: close");
+			if(p != NULL && p < in + head)
+				keep = 0;
+		}
+		else
+		{
+			keep = 0;
+			if(got > 0 || n < 0)
+				attempt++; // the server may have taken the request, do not send it twice
+		}
+		if(!keep)
+		{
+			close(httpFd);
+			httpFd = -1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	jitter_add(&serverTime, (long)(now.tv_sec - start.tv_sec) * 1000000L + (now.tv_nsec - start.tv_nsec) / 1000, 0);
+#ifdef LOADGEN
+	loadgen_sample(&start, code);
+#endif
+	return code;
+}
+
+#else
+/*
+ * Function: http_request
+ * Description: Run one request through curl and read the answer body and the status code
+ * Input parameters:
+ *					ip, port - server address
+ *					method   - "GET" or "POST"
+ *					path     - request path
+ *					headers  - extra header lines, each ending in "\r\n"
+ *					body     - form body of a POST, NULL for none
+ *					response - buffer for the answer body, always terminated
+ *					size     - size of the buffer
+ * Return value: HTTP status code, -1 if the server did not answer
+ */
+int http_request(const char *ip, const char *port, const char *method, const char *path, const char *headers, const char *body, char *response, int size)
+{
+	char command[REQUEST_MAX + 256];
+	char in[HTTP_RESPONSE_MAX + 8];
+	const char *line, *end;
+	char *nl;
+	FILE *fp;
+	int len, got = 0, n, code = -1;
+	struct timespec start, now;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	response[0] = '\0';
+	len = snprintf(command, sizeof(command), "curl -s -m %d.%03d -X %s -w '\\n%%{http_code}'",
+		HTTP_TIMEOUT_MS / 1000, HTTP_TIMEOUT_MS % 1000, method);
+	for(line = headers; *line != '\0' && (end = strstr(line, "\r\n")) != NULL; line = end + 2)
+		len += snprintf(command + len, sizeof(command) - len, " -H '%.*s'", (int)(end - line), line);
+	if(body != NULL)
+		len += snprintf(command + len, sizeof(command) - len, " --data-binary '%s'", body);
+	snprintf(command + len, sizeof(command) - len, " 'http://%s:%s%s'", ip, port, path);
+	fflush(stdout); // curl shares the output
+	fp = popen(command, "r");
+	if(fp != NULL)
+	{
+		while(got < HTTP_RESPONSE_MAX && (n = fread(in + got, 1, HTTP_RESPONSE_MAX - got, fp)) > 0)
+			got += n;
+		pclose(fp);
+	}
+	in[got] = '\0';
+	nl = strrchr(in, '\n'); // -w puts the status code on a line of its own after the body
+	if(nl != NULL && atoi(nl + 1) > 0)
+	{
+		code = atoi(nl + 1);
+		*nl = '\0';
+		snprintf(response, size, "%s", in);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	jitter_add(&serverTime, (long)(now.tv_sec - start.tv_sec) * 1000000L + (now.tv_nsec - start.tv_nsec) / 1000, 0);
+	return code;
+}
+#endif
+
+/* Upload a record right away, a failed upload is counted in the heartbeat and not sent again */
+void insert(const char *colum1, long value1, const char *colum2, long value2, const char *colum3, long value3, const char *colum4, long value4, const char *ip, const char *port, const char *table)
+{
+	char path[24];
+	char headers[48] = "";
+	char answer[32];
+	int code;
+
+	evlog(EV_RECORD_UPLOAD, 0, value1, value3);
+	if(traceMode == TRACE_REPLAY)
+		return;
+	snprintf(path, sizeof(path), "/%s", table);
+	request_begin();
+	request_P(colum1);
+	request_P("=");
+	request_long(value1);
+	request_P("&");
+	request_P(colum2);
+	request_P("=");
+	request_long(value2);
+	request_P("&");
+	request_P(colum3);
+	request_P("=");
+	request_long(value3);
+	request_P("&");
+	request_P(colum4);
+	request_P("=");
+	request_long(value4);
+#ifdef LOADGEN
+	if(recordBoot == 0)
+		recordBoot = time(NULL);
+	snprintf(headers, sizeof(headers), "X-Record-Id: %u.%lu.%lu\r\n", stationId, (unsigned long)recordBoot, (unsigned long)++recordSeq);
+#endif
+	code = http_request(ip, port, "POST", path, headers, request, answer, sizeof(answer));
+	recordSent = 1;
+	if(code < 0 || code >= 500)
+	{
+		recordsDropped++;
+		printf("Record upload failed, HTTP %d\n", code);
+	}
+	else if(code >= 300)
+		printf("Record rejected by the server, HTTP %d\n", code);
+}
+
+/* Return the user status from the database, -1 if there is no answer or the server knows a newer card record than seq */
+int retrieval_user_status(const char *ip, const char *port, long SN, uint seq)
+{
+	char answer[32];
+	int userStatus = -1;
+	int code;
+
+	if(traceMode == TRACE_REPLAY)
+		return trace_value(TR_STATUS, 0, userStatus);
+
+	request_begin();
+	request_P("/users/");
+	request_long(SN);
+	request_P("/status?seq=");
+	request_long(seq);
+	evlog(EV_STATUS_QUERY, 0, SN, 0);
+	code = http_request(ip, port, "GET", request, "", NULL, answer, sizeof(answer));
+	if(code == 200)
+		sscanf(answer, "%d", &userStatus);
+	else if(code == 409) // a copy of an old record written back to the card
+		evlog(EV_STALE_RECORD, 0, seq, 0);
+	return trace_value(TR_STATUS, 0, userStatus);
+}
+#else
+/* The record goes to the gateway with the next uplink frame, the column names are implied by MSG_RECORD */
+void insert(const char *colum1, long value1, const char *colum2, long value2, const char *colum3, long value3, const char *colum4, long value4, const char *ip, const char *port, const char *table)
+{
+	uchar data[9];
+
+	uplink_put32(data, value1);
+	data[4] = value2 >> 8;
+	data[5] = value2;
+	data[6] = value3;
+	data[7] = value4 >> 8;
+	data[8] = value4;
+	evlog(EV_RECORD_UPLOAD, 0, value1, value3);
+	if(uplink_send(&uplink, MSG_RECORD, data, sizeof(data)) != MI_OK)
+		PUTS("Uplink queue full, record dropped");
+	uplinkRecorded = 1; // the slot change follows once the session is over
+	uplink_flush(&uplink);
+}
+
+/* Ask the gateway for the user status, -1 if there is no answer */
+int retrieval_user_status(const char *ip, const char *port, long SN, uint seq)
+{
+	uchar data[6];
+	unsigned long start;
+
+	uplinkStatus = -1;
+	if(traceMode == TRACE_REPLAY)
+		return trace_value(TR_STATUS, 0, uplinkStatus);
+
+	uplink_put32(data, SN);
+	data[4] = seq >> 8;
+	data[5] = seq;
+	uplinkQuery = SN;
+	uplinkAnswered = 0;
+	evlog(EV_STATUS_QUERY, 0, SN, 0);
+	if(uplink_send(&uplink, MSG_STATUS_QUERY, data, sizeof(data)) == MI_OK)
+	{
+		start = uplink_ms();
+		while(!uplinkAnswered && uplink_ms() - start < REQUEST_TIMEOUT_MS)
+			uplink_poll(&uplink);
+		jitter_add(&serverTime, (uplink_ms() - start) * 1000UL, 0);
+	}
+	return trace_value(TR_STATUS, 0, uplinkStatus);
+}
+#endif
+
+/* ----------Uplink function---------- */
+/* Uplink clock: real time on Linux, where the host build runs a virtual millis() */
+unsigned long uplink_ms(void)
+{
+#ifdef GALILEO
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+#else
+	return millis();
+#endif
+}
+
+/* Start a link, the first frame introduces this station with MSG_HELLO */
+void uplink_open(UplinkLink *link, int fd)
+{
+	uchar data[2];
+
+	memset(link, 0, sizeof(*link));
+	link->fd = fd;
+	link->nextSeq = 1;
+	data[0] = stationId >> 8;
+	data[1] = stationId;
+	uplink_send(link, MSG_HELLO, data, sizeof(data));
+}
+
+/* CRC-16/CCITT, polynomial 0x1021, initial value 0xFFFF */
+uint uplink_crc(uint crc, uchar b)
+{
+	uchar i;
+
+	crc ^= (uint)b << 8;
+	for(i = 0; i < 8; i++)
+		crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	return crc & 0xFFFF;
+}
+
+void uplink_put32(uchar *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+uint32_t uplink_get32(const uchar *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/*
+ * Function: uplink_frame
+ * Description: Send one frame, it acknowledges the last frame received from the peer
+ * Input parameters:
+ *					link    - uplink
+ *					seq     - sequence number, 0 for an ack without data
+ *					payload - messages
+ *					len     - payload length
+ */
+void uplink_frame(UplinkLink *link, uchar seq, const uchar *payload, uchar len)
+{
+	uchar frame[1 + 2 * (3 + UPLINK_PAYLOAD_MAX + 2)];
+	uchar raw[3 + UPLINK_PAYLOAD_MAX + 2];
+	uint crc = 0xFFFF;
+	uchar i, n = 0;
+
+	raw[0] = len;
+	raw[1] = seq;
+	raw[2] = link->lastSeq;
+	memcpy(raw + 3, payload, len);
+	for(i = 0; i < 3 + len; i++)
+		crc = uplink_crc(crc, raw[i]);
+	raw[3 + len] = crc >> 8;
+	raw[4 + len] = crc;
+	frame[n++] = UPLINK_SOF;
+	for(i = 0; i < 5 + len; i++)
+	{
+		if(raw[i] == UPLINK_SOF || raw[i] == UPLINK_ESC)
+		{
+			frame[n++] = UPLINK_ESC;
+			frame[n++] = raw[i] ^ 0x20;
+		}
+		else
+			frame[n++] = raw[i];
+	}
+	link->ackDue = 0;
+#ifdef NODE
+	Serial.write(frame, n);
+#else
+	if(write(link->fd, frame, n) != n)
+		link->ackDue = 1; // the port is not ready, try again with the next flush
+#endif
+}
+
+/*
+ * Function: uplink_send
+ * Description: Queue one message for the next frame
+ * Input parameters:
+ *					link - uplink
+ *					type - MSG_*
+ *					data - message data
+ *					len  - data length
+ * Return value: successful return MI_OK, MI_ERR if the queue stays full
+ */
+uchar uplink_send(UplinkLink *link, uchar type, const uchar *data, uchar len)
+{
+	unsigned long start = uplink_ms();
+
+	// wait for the frame in flight to be acked when the queue is full
+	while(link->queueLen + 2 + len > UPLINK_PAYLOAD_MAX)
+	{
+		if(uplink_ms() - start >= UPLINK_RETRY_MS * (UPLINK_RETRIES + 1))
+			return MI_ERR;
+		uplink_poll(link);
+	}
+	link->queue[link->queueLen++] = type;
+	link->queue[link->queueLen++] = len;
+	memcpy(link->queue + link->queueLen, data, len);
+	link->queueLen += len;
+	uplink_flush(link);
+	return MI_OK;
+}
+
+/* Send the queued messages once nothing is in flight, repeat a frame that was not acked, ack what came in */
+void uplink_flush(UplinkLink *link)
+{
+	if(link->txSeq != 0 && uplink_ms() - link->sentMs >= UPLINK_RETRY_MS)
+	{
+		if(++link->retries > UPLINK_RETRIES)
+		{
+			link->txSeq = 0; // the peer is gone, give the frame up
+			link->drops++;
+#ifdef NODE
+			heartbeat.known &= ~heartbeat.inFlight; // send these fields again
+			heartbeat.inFlight = 0;
+			heartbeat.valid = 0;
+#endif
+		}
+		else
+		{
+			uplink_frame(link, link->txSeq, link->txBuf, link->txLen);
+			link->sentMs = uplink_ms();
+		}
+	}
+	if(link->txSeq == 0 && link->queueLen != 0)
+	{
+		memcpy(link->txBuf, link->queue, link->queueLen);
+		link->txLen = link->queueLen;
+		link->queueLen = 0;
+#ifdef NODE
+		heartbeat.inFlight = heartbeat.queued;
+		heartbeat.queued = 0;
+#endif
+		link->txSeq = link->nextSeq;
+		link->nextSeq = link->nextSeq == 255 ? 1 : link->nextSeq + 1;
+		link->retries = 0;
+		uplink_frame(link, link->txSeq, link->txBuf, link->txLen);
+		link->sentMs = uplink_ms();
+	}
+	if(link->ackDue)
+		uplink_frame(link, 0, NULL, 0);
+}
+
+/* Feed one received byte to the frame decoder */
+void uplink_receive(UplinkLink *link, uchar c)
+{
+	uchar i;
+
+	if(c == UPLINK_SOF) // a frame starts here, whatever came before
+	{
+		link->rxCrc = 0xFFFF;
+		link->rxEsc = 0;
+		link->rxState = RX_LEN;
+		return;
+	}
+	if(link->rxState == RX_SOF)
+		return;
+	if(c == UPLINK_ESC)
+	{
+		link->rxEsc = 1;
+		return;
+	}
+	if(link->rxEsc)
+	{
+		c ^= 0x20;
+		link->rxEsc = 0;
+	}
+	switch(link->rxState)
+	{
+		case RX_LEN:
+			link->rxLen = c;
+			link->rxPos = 0;
+			link->rxState = c <= UPLINK_PAYLOAD_MAX ? RX_SEQ : RX_SOF;
+			break;
+		case RX_SEQ:
+			link->rxSeq = c;
+			link->rxState = RX_ACK;
+			break;
+		case RX_ACK:
+			link->rxAck = c;
+			link->rxState = link->rxLen ? RX_PAYLOAD : RX_CRC_HI;
+			break;
+		case RX_PAYLOAD:
+			link->rxBuf[link->rxPos++] = c;
+			if(link->rxPos == link->rxLen)
+				link->rxState = RX_CRC_HI;
+			break;
+		case RX_CRC_HI:
+			link->rxCrc ^= (uint)c << 8;
+			link->rxState = RX_CRC_LO;
+			return;
+		case RX_CRC_LO:
+			link->rxState = RX_SOF;
+			if((link->rxCrc ^ c) != 0)
+				return; // corrupted, the sender repeats the frame
+			if(link->rxAck != 0 && link->rxAck == link->txSeq)
+			{
+				link->txSeq = 0;
+#ifdef NODE
+				heartbeat_acked(&heartbeat);
+#endif
+			}
+			if(link->rxSeq == 0)
+				return;
+			link->ackDue = 1;
+			if(link->rxSeq == link->lastSeq && (link->rxLen == 0 || link->rxBuf[0] != MSG_HELLO))
+				return; // a repeat of a frame we already have, only the ack was lost
+			link->lastSeq = link->rxSeq;
+			for(i = 0; i + 2 <= link->rxLen && i + 2 + link->rxBuf[i + 1] <= link->rxLen; i += 2 + link->rxBuf[i + 1])
+				uplink_message(link, link->rxBuf[i], link->rxBuf + i + 2, link->rxBuf[i + 1]);
+			return;
+	}
+	link->rxCrc = uplink_crc(link->rxCrc, c);
+}
+
+/* Handle one message from the peer */
+void uplink_message(UplinkLink *link, uchar type, const uchar *data, uchar len)
+{
+	if(type == MSG_HELLO && len == 2)
+	{
+		link->stationId = (data[0] << 8) | data[1];
+#ifdef NODE
+		heartbeat.known = 0; // the gateway has restarted and knows nothing about this node
+		heartbeat.valid = 0;
+#endif
+		return;
+	}
+#ifdef NODE
+	if(type == MSG_STATUS && len == 5 && (long)uplink_get32(data) == uplinkQuery)
+	{
+		uplinkStatus = (signed char)data[4];
+		uplinkAnswered = 1;
+	}
+#else
+	if((type == MSG_STATUS_QUERY && len == 6) || (type == MSG_RECORD && len == 9) || (type == MSG_HEARTBEAT && len % 3 == 0))
+		gateway_job(link, type, data, len);
+#endif
 }
 
-void reset_motor()
+/* Read what arrived, then flush */
+void uplink_poll(UplinkLink *link)
 {
-	if(total_time > 0)
+#ifdef NODE
+	while(Serial.available() > 0)
+		uplink_receive(link, Serial.read());
+#else
+	uchar buf[64];
+	int n, i;
+
+	while((n = read(link->fd, buf, sizeof(buf))) > 0)
 	{
-		reversal(total_time);
+		for(i = 0; i < n; i++)
+			uplink_receive(link, buf[i]);
 	}
-	else if(total_time < 0)
+#endif
+	uplink_flush(link);
+}
+
+/* ----------Heartbeat function---------- */
+/* Counters and times are reported up to 0x7FFF, the range of an uplink value */
+int heartbeat_clamp(unsigned long v)
+{
+	return v > 0x7FFF ? 0x7FFF : (int)v;
+}
+
+/* Read the state of this station into hb->value */
+void heartbeat_sample(Heartbeat *hb)
+{
+	int *v = hb->value;
+
+	v[HB_SLOT_1] = digitalRead(ubl_1); // not slot_read(), a heartbeat is no part of the SPI trace
+	v[HB_SLOT_2] = digitalRead(ubl_2);
+	v[HB_LOCK] = total_time;
+	v[HB_UNLOCKS] = heartbeat_clamp(unlockCount);
+	v[HB_SPI_STEP] = spiStep;
+	v[HB_SPI_DROPS] = heartbeat_clamp(spiDrops);
+	v[HB_CARD_ERRORS] = heartbeat_clamp(cardErrors);
+#ifdef NODE
+	v[HB_QUEUED] = uplink.queueLen;
+	v[HB_DROPPED] = heartbeat_clamp(uplink.drops);
+#else
+	v[HB_QUEUED] = 0; // records go out at once
+	v[HB_DROPPED] = heartbeat_clamp(recordsDropped);
+#endif
+	v[HB_POLL_MAX_US] = heartbeat_clamp(pollJitter.max);
+	v[HB_POLL_MISSES] = heartbeat_clamp(pollJitter.misses);
+	v[HB_TX_MAX_US] = heartbeat_clamp(transceiveJitter.max);
+	v[HB_TX_MISSES] = heartbeat_clamp(transceiveJitter.misses);
+	v[HB_SERVER_AVG_MS] = serverTime.count ? heartbeat_clamp(serverTime.sum / serverTime.count / 1000) : 0;
+	v[HB_SERVER_MAX_MS] = heartbeat_clamp(serverTime.max / 1000);
+	v[HB_BOOT_MS] = heartbeat_clamp(bootPollUs / 1000);
+}
+
+/*
+ * Function: heartbeat_due
+ * Description: Whether a heartbeat has to go out: the first one after boot, HEARTBEAT_MS after
+ *              the last one, or a changed trigger field HEARTBEAT_MIN_MS after the last one
+ * Input parameters:
+ *					hb    - heartbeat with a fresh sample
+ *					force - records were just uploaded, a changed trigger field goes along at once
+ */
+uchar heartbeat_due(Heartbeat *hb, uchar force)
+{
+	unsigned long elapsed = uplink_ms() - hb->sentMs;
+	uchar i;
+
+	if(hb->seq == 0 || elapsed >= HEARTBEAT_MS || hb->more)
+		return 1;
+	if(!force && elapsed < HEARTBEAT_MIN_MS)
+		return 0;
+	if(!hb->valid)
+		return 1;
+	for(i = 0; i < HB_FIELDS; i++)
 	{
-		forward(total_time*(-1));
+		if(((heartbeatTriggers >> i) & 1) && hb->value[i] != hb->acked[i])
+			return 1;
+	}
+	return 0;
+}
+
+/* Send the heartbeat of this station when it is due, force: records were just uploaded */
+void heartbeat_poll(uchar force)
+{
+	uchar ok;
+
+	if(traceMode == TRACE_REPLAY)
+		return;
+	heartbeat_sample(&heartbeat);
+	if(!heartbeat_due(&heartbeat, force))
+		return;
+#ifdef NODE
+	ok = heartbeat_uplink(&heartbeat) == MI_OK;
+#else
+	ok = heartbeat_post(&heartbeat, stationId) / 100 == 2;
+#endif
+	if(ok)
+		memset(&serverTime, 0, sizeof(serverTime)); // the next heartbeat sums up a new window
+}
+
+#ifdef NODE
+/*
+ * Function: heartbeat_uplink
+ * Description: Queue the fields that differ from the state the gateway holds, all of them after
+ *              a gateway restart, as one MSG_HEARTBEAT; an empty message only says alive. Only
+ *              what fits the uplink queue goes out, the rest follows with the next polls, so the
+ *              card loop never waits for an ack. A field counts as held once the frame carrying
+ *              it is acked, a dropped frame sends its fields again.
+ * Return value: MI_OK once every field of the heartbeat is queued, MI_ERR while some wait
+ */
+uchar heartbeat_uplink(Heartbeat *hb)
+{
+	uchar data[3 * HB_UPLINK_FIELDS];
+	uchar i, n = 0;
+	uchar room = UPLINK_PAYLOAD_MAX - uplink.queueLen;
+	uint32_t fields = 0;
+
+	hb->more = 0;
+	for(i = 0; i < HB_FIELDS; i++)
+	{
+		if(((hb->known >> i) & 1) && hb->value[i] == hb->acked[i])
+			continue;
+		if(((hb->queued | hb->inFlight) >> i) & 1)
+		{
+			if(hb->value[i] != hb->sent[i])
+				hb->more = 1; // the change goes out after the ack
+			continue;
+		}
+		if(n + 3u > sizeof(data) || 2 + n + 3 > room)
+		{
+			hb->more = 1;
+			continue;
+		}
+		data[n++] = i;
+		data[n++] = hb->value[i] >> 8;
+		data[n++] = hb->value[i];
+		hb->sent[i] = hb->value[i];
+		fields |= (uint32_t)1 << i;
+	}
+	if(n == 0)
+	{
+		if(hb->more || room < 2)
+		{
+			hb->more = 1;
+			return MI_ERR;
+		}
+		if(hb->queued | hb->inFlight)
+			return MI_OK; // the heartbeat on its way says alive
+	}
+	if(uplink_send(&uplink, MSG_HEARTBEAT, data, n) != MI_OK)
+		return MI_ERR;
+	hb->queued |= fields;
+	hb->seq++;
+	hb->sentMs = uplink_ms();
+	return hb->more ? MI_ERR : MI_OK;
+}
+
+/* The frame in flight was acked, the gateway holds its heartbeat fields */
+void heartbeat_acked(Heartbeat *hb)
+{
+	uchar i;
+
+	for(i = 0; i < HB_FIELDS; i++)
+	{
+		if((hb->inFlight >> i) & 1)
+			hb->acked[i] = hb->sent[i];
+	}
+	hb->known |= hb->inFlight;
+	hb->inFlight = 0;
+	hb->valid = hb->known == heartbeatAll;
+}
+#else
+/*
+ * Function: heartbeat_post
+ * Description: POST /stations/<id>/heartbeat with seq=<n>&full=<0|1>&<name>=<value>... for the
+ *              fields that differ from the acknowledged state, all of them if full. The server
+ *              answers 409 to a partial heartbeat of a station it holds no state for.
+ * Input parameters:
+ *					hb      - heartbeat with the values to report
+ *					station - station id the heartbeat belongs to
+ * Return value: HTTP status code, -1 if the server did not answer
+ */
+int heartbeat_post(Heartbeat *hb, uint station)
+{
+	char path[40];
+	char answer[32];
+	uchar i;
+	int code;
+
+	hb->seq++;
+	hb->sentMs = uplink_ms();
+	request_begin();
+	request_P("seq=");
+	request_long(hb->seq);
+	request_P("&full=");
+	request_long(!hb->valid);
+	for(i = 0; i < HB_FIELDS; i++)
+	{
+		if(hb->valid && hb->value[i] == hb->acked[i])
+			continue;
+		request_P("&");
+		request_P(heartbeatNames[i]);
+		request_P("=");
+		request_long(hb->value[i]);
+	}
+	snprintf(path, sizeof(path), "/stations/%u/heartbeat", station);
+	code = http_request(SERVER, "POST", path, "", request, answer, sizeof(answer));
+	if(code / 100 == 2)
+	{
+		memcpy(hb->acked, hb->value, sizeof(hb->acked));
+		hb->valid = 1;
+	}
+	else if(code == 409)
+	{
+		hb->valid = 0;
+		hb->seq = 0; // send the complete state right away
+	}
+	return code;
+}
+#endif
+
+/* ----------Gateway function---------- */
+#ifndef NODE
+/*
+ * Function: gateway_port
+ * Description: Open a node serial port, "path" or "path@baud" (default 115200)
+ * Return value: file descriptor, -1 on error
+ */
+int gateway_port(const char *path)
+{
+	char name[64];
+	const char *at = strchr(path, '@');
+	long baud = at ? atol(at + 1) : 115200;
+	speed_t speed;
+	struct termios tio;
+	int fd;
+
+	snprintf(name, sizeof(name), "%.*s", at ? (int)(at - path) : (int)strlen(path), path);
+	switch(baud)
+	{
+		case 9600: speed = B9600; break;
+		case 19200: speed = B19200; break;
+		case 38400: speed = B38400; break;
+		case 57600: speed = B57600; break;
+		default: speed = B115200; break;
+	}
+	fd = open(name, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if(fd < 0)
+	{
+		perror(name);
+		return -1;
+	}
+	if(tcgetattr(fd, &tio) == 0)
+	{
+		cfmakeraw(&tio);
+		cfsetispeed(&tio, speed);
+		cfsetospeed(&tio, speed);
+		tcsetattr(fd, TCSANOW, &tio);
+	}
+	return fd;
+}
+
+/*
+ * Function: gateway_run
+ * Description: Serve status queries and record uploads of the sensor nodes, never returns normally
+ * Input parameters:
+ *					ports - node serial ports, see gateway_port
+ *					count - number of ports
+ *					ptys  - number of pseudo terminals to open for simulated nodes (SUC-node.elf --serial)
+ * Return value: 1 if no node can be served
+ */
+int gateway_run(char **ports, int count, int ptys)
+{
+	UplinkLink *links = gatewayLinks;
+	struct pollfd fds[GATEWAY_LINKS + 1];
+	struct termios tio;
+	pthread_t server;
+	char drain[16];
+	int n = 0, i, fd;
+
+	evlog_open();
+	stationId = 0; // the gateway introduces itself as station 0
+	for(i = 0; i < count && n < GATEWAY_LINKS; i++)
+	{
+		fd = gateway_port(ports[i]);
+		if(fd >= 0)
+			uplink_open(&links[n++], fd);
+	}
+	for(i = 0; i < ptys && n < GATEWAY_LINKS; i++)
+	{
+		fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+		if(fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0 || tcgetattr(fd, &tio) != 0)
+		{
+			perror("posix_openpt");
+			break;
+		}
+		cfmakeraw(&tio);
+		tcsetattr(fd, TCSANOW, &tio);
+		printf("Node port %s\n", ptsname(fd));
+		uplink_open(&links[n++], fd);
 	}
+	if(n == 0)
+	{
+		puts("No node port to serve");
+		return 1;
+	}
+	if(pipe(gatewayPipe) != 0 || pthread_create(&server, NULL, gateway_server, NULL) != 0)
+	{
+		perror("gateway server thread");
+		return 1;
+	}
+	fcntl(gatewayPipe[0], F_SETFL, O_NONBLOCK);
+	fflush(stdout);
+
+	while(1)
+	{
+		for(i = 0; i < n; i++)
+		{
+			fds[i].fd = links[i].fd;
+			fds[i].events = POLLIN;
+		}
+		fds[n].fd = gatewayPipe[0];
+		fds[n].events = POLLIN;
+		poll(fds, n + 1, UPLINK_RETRY_MS / 2);
+		while(read(gatewayPipe[0], drain, sizeof(drain)) > 0)
+			;
+		gateway_answer();
+		for(i = 0; i < n; i++)
+			uplink_poll(&links[i]);
+		fflush(stdout);
+	}
+}
+
+/* Hand a node message to the server thread, the frame is acked at once */
+void gateway_job(UplinkLink *link, uchar type, const uchar *data, uchar len)
+{
+	GatewayJob *job;
+
+	pthread_mutex_lock(&gatewayLock);
+	if(jobCount == GATEWAY_JOBS)
+		printf("Station %u: gateway job queue full, message %u dropped\n", link->stationId, type);
 	else
-	{}	// total_time = 0, do nothing
+	{
+		job = &gatewayJobs[(jobHead + jobCount++) % GATEWAY_JOBS];
+		job->link = link - gatewayLinks;
+		job->type = type;
+		job->len = len;
+		memcpy(job->data, data, len);
+		job->station = link->stationId;
+		pthread_cond_signal(&gatewayWake);
+	}
+	pthread_mutex_unlock(&gatewayLock);
 }
 
-/* ----------Database function---------- */
-void insert(char *colum1, int value1, char *colum2, int value2, char *colum3, int value3, char *ip, char *port, char *table)
-{
-	char command[256] = "curl --data ";
-	char data[128] = "\"";
-	char address[64] = " http://";
-	char v1[32], v2[8], v3[8];
-	sprintf(v1, "%d", value1);
-	sprintf(v2, "%d", value2);
-	sprintf(v3, "%d", value3);
-	
-	strcat(data, colum1);
-	strcat(data, "=");
-	strcat(data, v1);
-	strcat(data, "&");
-	strcat(data, colum2);
-	strcat(data, "=");
-	strcat(data, v2);
-	strcat(data, "&");
-	strcat(data, colum3);
-	strcat(data, "=");
-	strcat(data, v3);
-	strcat(data, "\"");
-	//printf("%s\n", data);
-	
-	strcat(address, ip);
-	strcat(address, ":");
-	strcat(address, port);
-	strcat(address, "/");
-	strcat(address, table);
-	//printf("%s\n", address);
-	
-	strcat(command, data);
-	strcat(command, address);
-	printf("Execute command: %s\n", command);
-	system(command);
+/* Server thread: act on one node message */
+void gateway_job_run(GatewayJob *job)
+{
+	GatewayJob *answer;
+	GatewayNode *node = &gatewayNodes[job->link];
+	const uchar *data = job->data;
+	long serialNumber = uplink_get32(data);
+	int status;
+	uchar i;
+
+	if(job->type == MSG_STATUS_QUERY)
+	{
+		status = retrieval_user_status(SERVER, serialNumber, (data[4] << 8) | data[5]);
+		printf("Station %u: user status of %ld is %d\n", job->station, serialNumber, status);
+		pthread_mutex_lock(&gatewayLock);
+		if(answerCount < GATEWAY_JOBS)
+		{
+			answer = &gatewayAnswers[(answerHead + answerCount++) % GATEWAY_JOBS];
+			answer->link = job->link;
+			answer->type = MSG_STATUS;
+			answer->len = 5;
+			uplink_put32(answer->data, serialNumber);
+			answer->data[4] = status;
+		}
+		pthread_mutex_unlock(&gatewayLock);
+		if(write(gatewayPipe[1], "", 1) != 1)
+			perror("gateway pipe");
+	}
+	else if(job->type == MSG_RECORD)
+	{
+		// The station is the one that said hello on this link, a record naming another station is not stored
+		if((uint)((data[4] << 8) | data[5]) != job->station)
+			printf("Station %u: record card %ld names station %u, dropped\n", job->station, serialNumber, (data[4] << 8) | data[5]);
+		else
+		{
+			printf("Station %u: record card %ld action %u\n", job->station, serialNumber, data[6]);
+			insert("userCard", serialNumber, "stationId", job->station, "action", data[6], "cardSeq", (data[7] << 8) | data[8], SERVER, "records");
+		}
+	}
+	else if(job->type == MSG_HEARTBEAT)
+	{
+		for(i = 0; i < job->len; i += 3)
+		{
+			if(data[i] < HB_FIELDS)
+			{
+				node->hb.value[data[i]] = (int16_t)((data[i + 1] << 8) | data[i + 2]);
+				node->hb.known |= (uint32_t)1 << data[i];
+			}
+		}
+		node->hb.pending = 1;
+		node->station = job->station;
+	}
 }
 
-void retrieval_user_status(char *ip, char *port, char *SN)
+/*
+ * Function: gateway_forward
+ * Description: Server thread: forward the node heartbeats that changed, once the node has reported
+ *              every field. A failed forward stays pending and is tried again after HEARTBEAT_MIN_MS,
+ *              a 409 sends the complete state at once.
+ */
+void gateway_forward(void)
 {
-	char command[256] = "curl -s ";
-	char address[64] = "http://";
-	
-	strcat(address, ip);
-	strcat(address, ":");
-	strcat(address, port);
-	strcat(address, "/");
-	strcat(address, "users/");
-	strcat(address, SN);
-	strcat(address, "/status");
-	//printf("%s\n", address);
-	
-	strcat(command, address);
-	strcat(command, " > userStatus.txt");
-	printf("Execute command: %s\n", command);
-	system(command);
+	GatewayNode *node;
+	uchar i;
+	int code;
+
+	for(i = 0; i < GATEWAY_LINKS; i++)
+	{
+		node = &gatewayNodes[i];
+		if(!node->hb.pending || node->station == 0 || node->hb.known != heartbeatAll)
+			continue;
+		if(node->retryAt != 0 && (long)(uplink_ms() - node->retryAt) < 0)
+			continue;
+		code = heartbeat_post(&node->hb, node->station);
+		node->retryAt = 0;
+		if(code / 100 == 2)
+			node->hb.pending = 0;
+		else if(code == 409)
+			printf("Station %u: the server holds no heartbeat state, sending it in full\n", node->station);
+		else
+			node->retryAt = uplink_ms() + HEARTBEAT_MIN_MS;
+	}
+}
+
+/*
+ * Function: gateway_server
+ * Description: Server thread of the gateway. It takes every waiting job first, so only status queries go
+ *              to the server ahead of a new one. Once no job waits it uploads the queued records in the
+ *              order they arrived and forwards the node heartbeats, all over the one kept-alive connection.
+ */
+void *gateway_server(void *arg)
+{
+	GatewayJob job;
+	struct timespec until;
+	uchar got;
+
+	(void)arg;
+	while(1)
+	{
+		pthread_mutex_lock(&gatewayLock);
+		if(jobCount == 0)
+		{
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_nsec += UPLINK_RETRY_MS / 2 * 1000000L;
+			if(until.tv_nsec >= 1000000000L)
+			{
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&gatewayWake, &gatewayLock, &until);
+		}
+		got = jobCount > 0;
+		if(got)
+		{
+			job = gatewayJobs[jobHead];
+			jobHead = (jobHead + 1) % GATEWAY_JOBS;
+			jobCount--;
+		}
+		pthread_mutex_unlock(&gatewayLock);
+		if(got)
+		{
+			gateway_job_run(&job);
+			continue; // take every waiting job first, a node gives up on its status answer after REQUEST_TIMEOUT_MS
+		}
+		gateway_forward();
+		fflush(stdout);
+	}
+	return NULL;
+}
+
+/* Queue the status answers of the server thread on their links, an answer that does not fit waits for the next round */
+void gateway_answer(void)
+{
+	GatewayJob *answer;
+	UplinkLink *link;
+
+	pthread_mutex_lock(&gatewayLock);
+	while(answerCount > 0)
+	{
+		answer = &gatewayAnswers[answerHead];
+		link = &gatewayLinks[answer->link];
+		if(link->queueLen + 2 + answer->len > UPLINK_PAYLOAD_MAX)
+			break;
+		uplink_send(link, answer->type, answer->data, answer->len);
+		answerHead = (answerHead + 1) % GATEWAY_JOBS;
+		answerCount--;
+	}
+	pthread_mutex_unlock(&gatewayLock);
+}
+#endif
+
+/* ----------Host user function---------- */
+#ifdef HOST
+STATION_LOCAL uchar hostUnlocked, hostActed; // what the user of the current session has seen and done
+
+/*
+ * Delay hook of the simulated user. While the green LED shows an open slot, the first long
+ * wait is the user taking or returning the umbrella: slot 1 if forward() drove its lock open
+ * (ENA high, IN2 low), otherwise slot 2, which has no lock motor.
+ */
+void host_user(unsigned long ms)
+{
+	int slot;
+
+	if(digitalRead(green) == LOW)
+	{
+		hostUnlocked = hostActed = 0; // no slot open, the next session starts over
+		return;
+	}
+	if(hostActed)
+		return;
+	if(digitalRead(ENA) == HIGH && digitalRead(IN2) == LOW)
+	{
+		hostUnlocked = 1;
+		return;
+	}
+	if(ms >= 1000)
+	{
+		slot = hostUnlocked ? ubl_1 : ubl_2;
+		host_pin_set(slot, !digitalRead(slot));
+		hostActed = 1;
+	}
+}
+#endif
+
+/* ----------Load generator function---------- */
+#ifdef LOADGEN
+/*
+ * Every simulated station is a thread running setup() and loop() against its own emulated
+ * MFRC522 and slot sensors. Its user taps one of LOADGEN_CARDS cards in turn, each time with
+ * blank card memory so the decision comes from the server, and takes or returns an umbrella
+ * while the slot is open. The server side is standin.c, which counts the records it received.
+ */
+#define LOADGEN_CARDS         4    // cards per station
+#define LOADGEN_STACK         (256*1024) // thread stack of a station
+
+typedef struct
+{
+	pthread_t thread;
+	uint id; // station id
+	unsigned long sessions; // card taps
+	unsigned long records; // records uploaded by insert()
+	unsigned long dropped; // uploads that failed
+	unsigned long requests;
+	unsigned long failures; // no answer or HTTP 5xx
+	unsigned long *latency; // micro seconds of each request
+	unsigned long latencyCap;
+} LoadStation;
+
+STATION_LOCAL LoadStation *loadStation = NULL; // NULL in the main thread
+volatile int loadStop = 0;
+int loadInterval = 100; // --interval: ms between the card taps of a station
+
+/* Count one server request of the station running in this thread */
+void loadgen_sample(struct timespec *start, int code)
+{
+	LoadStation *s = loadStation;
+	struct timespec now;
+	unsigned long *p;
+
+	if(s == NULL)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if(code < 0 || code >= 500)
+		s->failures++;
+	if(s->requests == s->latencyCap)
+	{
+		p = (unsigned long *)realloc(s->latency, (s->latencyCap * 2 + 256) * sizeof(*p));
+		if(p == NULL)
+			return;
+		s->latency = p;
+		s->latencyCap = s->latencyCap * 2 + 256;
+	}
+	s->latency[s->requests++] = (long)(now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+void *loadgen_station(void *arg)
+{
+	LoadStation *s = (LoadStation *)arg;
+	uchar uid[4];
+	uchar card = 0;
+
+	loadStation = s;
+	stationId = s->id;
+	host_delay_hook(host_user);
+	host_pin_set(ubl_1, HIGH); // both slots hold an umbrella
+	host_pin_set(ubl_2, HIGH);
+	setup();
+	while(!loadStop)
+	{
+		host_card_type(HOST_CARD_CLASSIC_1K); // blank memory, no card record
+		uid[0] = s->id >> 8;
+		uid[1] = s->id;
+		uid[2] = card;
+		uid[3] = 0x5A;
+		host_card_uid(uid);
+		host_card_present(1);
+		loop();
+		host_card_present(0);
+		loop(); // the card is gone, the records of the session go out
+		s->sessions++;
+		card = (card + 1) % LOADGEN_CARDS;
+		if(loadInterval > 0)
+			usleep(loadInterval * 1000); // the virtual clock runs the session itself without waiting
+	}
+	s->records = recordSeq;
+	s->dropped = recordsDropped;
+	if(httpFd >= 0)
+		close(httpFd);
+	return NULL;
+}
+
+int loadgen_compare(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Records of one station the server holds and the repeated uploads it received (standin GET /stats/<id>) */
+int loadgen_records(uint id, unsigned long *unique, unsigned long *duplicates)
+{
+	char path[32];
+	char answer[64];
+
+	snprintf(path, sizeof(path), "/stats/%u", id);
+	if(http_request(SERVER, "GET", path, "", NULL, answer, sizeof(answer)) != 200 || sscanf(answer, "%lu %lu", unique, duplicates) != 2)
+	{
+		printf("No record statistics from %s:%s for station %u\n", serverIp, serverPort, id);
+		return MI_ERR;
+	}
+	return MI_OK;
+}
+
+/*
+ * Function: loadgen_run
+ * Description: Run the stations stationId .. stationId + stations - 1 against the server,
+ *              then report the request rate, the latency percentiles and the records lost or duplicated
+ * Input parameters:
+ *					stations - number of simulated stations
+ *					seconds  - length of the run
+ * Return value: 0 if every record the server lacks is a failed upload, 1 otherwise
+ */
+int loadgen_run(int stations, int seconds)
+{
+	LoadStation *s = (LoadStation *)calloc(stations, sizeof(LoadStation));
+	unsigned long *before = (unsigned long *)calloc(stations * 2, sizeof(unsigned long));
+	unsigned long *all;
+	unsigned long requests = 0, sessions = 0, records = 0, failures = 0, dropped = 0;
+	unsigned long unique, duplicates, lost = 0, silent = 0, repeated = 0, n;
+	pthread_attr_t attr;
+	struct timespec t0, t1;
+	double elapsed;
+	int i, fd, saved, started = 0;
+
+	if(s == NULL || before == NULL)
+		return 1;
+	for(i = 0; i < stations; i++)
+	{
+		s[i].id = stationId + i;
+		if(loadgen_records(s[i].id, &before[2 * i], &before[2 * i + 1]) != MI_OK)
+			return 1;
+	}
+	printf("Load generator: %d stations against %s:%s for %d s, a card every %d ms\n", stations, serverIp, serverPort, seconds, loadInterval);
+
+	// Keep the setup messages of the stations out of the report
+	fflush(stdout);
+	saved = dup(1);
+	fd = open("/dev/null", O_WRONLY);
+	dup2(fd, 1);
+	close(fd);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, LOADGEN_STACK);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for(i = 0; i < stations; i++)
+	{
+		if(pthread_create(&s[i].thread, &attr, loadgen_station, &s[i]) != 0)
+			break;
+		started++;
+	}
+	sleep(seconds);
+	loadStop = 1;
+	for(i = 0; i < started; i++)
+		pthread_join(s[i].thread, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+	fflush(stdout);
+	dup2(saved, 1);
+	close(saved);
+	if(started < stations)
+		printf("Only %d stations started\n", started);
+
+	for(i = 0; i < started; i++)
+	{
+		requests += s[i].requests;
+		sessions += s[i].sessions;
+		records += s[i].records;
+		failures += s[i].failures;
+		dropped += s[i].dropped;
+	}
+	all = (unsigned long *)malloc((requests + 1) * sizeof(unsigned long));
+	if(all == NULL)
+		return 1;
+	for(i = 0, n = 0; i < started; i++)
+	{
+		memcpy(all + n, s[i].latency, s[i].requests * sizeof(unsigned long));
+		n += s[i].requests;
+	}
+	qsort(all, n, sizeof(unsigned long), loadgen_compare);
+	printf("Sessions %lu, requests %lu in %.1f s: %.0f requests/s, %lu failed\n", sessions, requests, elapsed, requests / elapsed, failures);
+	if(n > 0)
+		printf("Latency ms: p50 %.2f, p90 %.2f, p99 %.2f, p99.9 %.2f, max %.2f\n",
+			all[n / 2] / 1000.0, all[n * 9 / 10] / 1000.0, all[n * 99 / 100] / 1000.0, all[n * 999 / 1000] / 1000.0, all[n - 1] / 1000.0);
+
+	// Compare the records every station uploaded with what the server holds now
+	for(i = 0; i < started; i++)
+	{
+		if(loadgen_records(s[i].id, &unique, &duplicates) != MI_OK)
+			return 1;
+		unique -= before[2 * i];
+		repeated += duplicates - before[2 * i + 1];
+		if(unique < s[i].records)
+			lost += s[i].records - unique;
+		if(unique + s[i].dropped < s[i].records)
+			silent += s[i].records - s[i].dropped - unique; // gone without a failed upload to show for it
+	}
+	printf("Records %lu, lost %lu (%lu failed uploads, %lu without a failure), duplicated %lu\n", records, lost, dropped, silent, repeated);
+	return silent != 0;
 }
+#endif
 
+#ifdef GALILEO
 int main(int argc, char * argv[])
 {
+	int i;
+	int rfTune = 0;
+	int priority = 0;
+#ifdef HOST
+	int budget = 0;
+#endif
+#ifdef LOADGEN
+	int stations = 100;
+	int seconds = 10;
+#endif
+#ifdef NODE
+	unsigned long start;
+#endif
+	long loops = -1; // loop() iterations before exit, -1: forever
+
 	init(argc, argv);
 	puts("");
 	
+	for(i = 1; i < argc; i++)
+	{
+		if(strcmp(argv[i], "--rf-tune") == 0)
+			rfTune = 1;
+		else if(strcmp(argv[i], "--rt") == 0)
+			priority = (i + 1 < argc && atoi(argv[i + 1]) > 0) ? atoi(argv[++i]) : RT_PRIORITY;
+		else if(strcmp(argv[i], "--spi-trace") == 0 && i + 1 < argc)
+			trace_open(argv[++i], TRACE_CAPTURE);
+		else if(strcmp(argv[i], "--loops") == 0 && i + 1 < argc)
+			loops = atol(argv[++i]);
+		else if(strcmp(argv[i], "--station") == 0 && i + 1 < argc)
+			stationId = atoi(argv[++i]);
+		else if(strcmp(argv[i], "--session-window") == 0 && i + 1 < argc)
+			sessionWindow = atoi(argv[++i]);
+#ifdef NODE
+		else if(strcmp(argv[i], "--serial") == 0 && i + 1 < argc)
+			host_serial_open(argv[++i]);
+#else
+		else if(strcmp(argv[i], "--server") == 0 && i + 1 < argc)
+			sscanf(argv[++i], "%63[^:]:%7s", serverIp, serverPort);
+		else if(strcmp(argv[i], "--gateway") == 0)
+			return gateway_run(argv + i + 1, argc - i - 1, 0);
+		else if(strcmp(argv[i], "--gateway-pty") == 0 && i + 1 < argc)
+			return gateway_run(NULL, 0, atoi(argv[i + 1]));
+#endif
+#ifdef HOST
+		else if(strcmp(argv[i], "--spi-budget") == 0)
+			budget = 1;
+		else if(strcmp(argv[i], "--user") == 0)
+		{
+			host_delay_hook(host_user);
+			host_pin_set(ubl_1, HIGH); // an umbrella to borrow from slot 1, slot 2 is free for a return
+		}
+		else if(strcmp(argv[i], "--init-faults") == 0 && i + 1 < argc)
+			host_reader_lose_writes(atoi(argv[++i])); // the first reader inits fail, boot_reader starts over
+#endif
+#ifdef LOADGEN
+		else if(strcmp(argv[i], "--stations") == 0 && i + 1 < argc)
+			stations = atoi(argv[++i]);
+		else if(strcmp(argv[i], "--duration") == 0 && i + 1 < argc)
+			seconds = atoi(argv[++i]);
+		else if(strcmp(argv[i], "--interval") == 0 && i + 1 < argc)
+			loadInterval = atoi(argv[++i]);
+#endif
+		else if(strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+		{
+			if(trace_open(argv[++i], TRACE_REPLAY) != MI_OK)
+				return 1;
+		}
+	}
+	
+#ifdef LOADGEN
+	return loadgen_run(stations, seconds);
+#endif
+	setup();
+	if(rfTune)
+	{
+		rf_tune();
+		return 0;
+	}
+#ifdef HOST
+	if(budget)
+	{
+		return spi_budget_check();
+	}
+#endif
+	if(priority)
+	{
+		rt_init(priority);
+	}
+	while(loops != 0)
+	{
+		loop();
+		if(loops > 0)
+			loops--;
+	}
+	trace_flush();
+#ifdef NODE
+	start = uplink_ms(); // the last records still go to the gateway
+	while((uplink.txSeq != 0 || uplink.queueLen != 0) && uplink_ms() - start < UPLINK_RETRY_MS * (UPLINK_RETRIES + 1))
+		uplink_poll(&uplink);
+#endif
+	return 0;
+}
+#else
+/*
+ * The Galileo entry above calls init(argc, argv) of the Galileo core. The AVR core declares
+ * init(void), so the uno/nano builds get the same sequence as the main() of the AVR core.
+ */
+int main(void)
+{
+	init();
 	setup();
 	while(1)
 	{
 		loop();
 	}
 }
+#endif
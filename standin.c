@@ -0,0 +1,458 @@
+/*
+ * Local stand-in for the station REST API, for load tests of the station client
+ *
+ * Usage: standin [-p port] [-l latency_ms] [-j jitter_ms] [-f fail_percent] [-d drop_percent]
+ *        -p  listening port, default 3999
+ *        -l  answer delay of every request
+ *        -j  random extra delay up to this many ms
+ *        -f  answer this share of the requests with 503 without acting on them
+ *        -d  act on this share of the requests, then close the connection without answering
+ *
+ * GET  /users/<SN>/status?seq=<n>  user status: 0 can borrow, 1 can return; 409 if the
+ *                          card record sequence number n is older than the last record of the card
+ * POST /records            userCard=<SN>&stationId=<id>&action=<0 borrow, 1 return>&cardSeq=<n>
+ * GET  /stats/<id>         "<records> <duplicates>" received from station <id>
+ * POST /stations/<id>/heartbeat  seq=<n>&full=<0|1>&<field>=<value>..., the changed fields
+ *                          unless full; 409 to a partial heartbeat of an unknown station, 400 without seq
+ * GET  /stations/<id>/heartbeat  the station state put together from its heartbeats
+ *
+ * A record whose X-Record-Id header was seen before is counted as a duplicate
+ * and changes nothing. Latency and failures are not applied to /stats. Ctrl-C
+ * prints the totals.
+ */
+
+#define _GNU_SOURCE // strcasestr
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define REQUEST_MAX           2048 // headers and body of one request
+#define STATIONS              65536 // station ids the statistics cover
+#define TABLE_MIN             4096 // initial slots of a hash table, a power of 2
+#define ANSWER_MAX            768  // answer body
+#define FIELDS_MAX            32   // heartbeat fields of a station
+
+// Open addressing hash table from a 64 bit key to an int, key 0 marks a free slot
+typedef struct
+{
+	uint64_t *keys;
+	int *values;
+	unsigned long size; // slots
+	unsigned long count; // used slots
+} Table;
+
+typedef struct
+{
+	unsigned long records;
+	unsigned long duplicates;
+} StationStats;
+
+// State of a station from its heartbeats
+typedef struct
+{
+	unsigned long seq; // last heartbeat
+	int count;
+	char name[FIELDS_MAX][24];
+	long value[FIELDS_MAX];
+} StationState;
+
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+Table users; // serial number + 1 -> user status
+Table cardSeqs; // serial number + 1 -> card record sequence number of the last record
+Table records; // hash of X-Record-Id -> 1
+StationStats stations[STATIONS];
+StationState *states[STATIONS]; // NULL until the first complete heartbeat
+unsigned long requests = 0, failed = 0, dropped = 0, totalRecords = 0, totalDuplicates = 0;
+unsigned long heartbeats = 0, heartbeatFields = 0;
+
+int latencyMs = 0, jitterMs = 0, failPercent = 0, dropPercent = 0;
+
+uint64_t hash_string(const char *s, int len)
+{
+	uint64_t h = 1469598103934665603ULL; // FNV-1a
+
+	while(len-- > 0)
+	{
+		h ^= (unsigned char)*s++;
+		h *= 1099511628211ULL;
+	}
+	return h ? h : 1;
+}
+
+/* Slot of key, free if the key is not in the table */
+unsigned long table_slot(Table *t, uint64_t key)
+{
+	unsigned long i = (key * 0x9E3779B97F4A7C15ULL) & (t->size - 1);
+
+	while(t->keys[i] != 0 && t->keys[i] != key)
+		i = (i + 1) & (t->size - 1);
+	return i;
+}
+
+int *table_get(Table *t, uint64_t key, int create)
+{
+	Table bigger;
+	unsigned long i;
+
+	if(t->size == 0 || (create && (t->count + 1) * 2 > t->size))
+	{
+		bigger.size = t->size ? t->size * 2 : TABLE_MIN;
+		bigger.count = 0;
+		bigger.keys = (uint64_t *)calloc(bigger.size, sizeof(uint64_t));
+		bigger.values = (int *)calloc(bigger.size, sizeof(int));
+		if(bigger.keys == NULL || bigger.values == NULL)
+		{
+			perror("calloc");
+			exit(1);
+		}
+		for(i = 0; i < t->size; i++)
+		{
+			if(t->keys[i] != 0)
+			{
+				unsigned long j = table_slot(&bigger, t->keys[i]);
+				bigger.keys[j] = t->keys[i];
+				bigger.values[j] = t->values[i];
+				bigger.count++;
+			}
+		}
+		free(t->keys);
+		free(t->values);
+		*t = bigger;
+	}
+	i = table_slot(t, key);
+	if(t->keys[i] == 0)
+	{
+		if(!create)
+			return NULL;
+		t->keys[i] = key;
+		t->values[i] = 0;
+		t->count++;
+	}
+	return &t->values[i];
+}
+
+/* Value of name=<number> in a form body, -1 if it is missing */
+long form_long(const char *body, const char *name)
+{
+	const char *p = body;
+	int len = strlen(name);
+
+	while(p != NULL)
+	{
+		if(strncmp(p, name, len) == 0 && p[len] == '=')
+			return atol(p + len + 1);
+		p = strchr(p, '&');
+		if(p != NULL)
+			p++;
+	}
+	return -1;
+}
+
+/* Header value of name, NULL if the request has none */
+const char *header(const char *head, const char *name, int *len)
+{
+	const char *p = head;
+	int n = strlen(name);
+
+	while((p = strstr(p, "\r\n")) != NULL)
+	{
+		p += 2;
+		if(strncasecmp(p, name, n) == 0 && p[n] == ':')
+		{
+			p += n + 1;
+			while(*p == ' ')
+				p++;
+			*len = strcspn(p, "\r\n");
+			return p;
+		}
+	}
+	return NULL;
+}
+
+/* Apply a heartbeat body to the state of a station, return the HTTP status */
+int heartbeat(long station, const char *body, char *answer, int size)
+{
+	StationState *st = states[station];
+	const char *p = body;
+	char name[24];
+	long value, seq = form_long(body, "seq");
+	int i, n;
+
+	if(seq < 0)
+	{
+		snprintf(answer, size, "Missing seq");
+		return 400;
+	}
+	if(form_long(body, "full") != 1 && st == NULL)
+	{
+		snprintf(answer, size, "Full heartbeat required");
+		return 409;
+	}
+	if(st == NULL)
+	{
+		st = states[station] = (StationState *)calloc(1, sizeof(StationState));
+		if(st == NULL)
+			return 500;
+	}
+	if(form_long(body, "full") == 1)
+		st->count = 0;
+	st->seq = seq;
+	heartbeats++;
+	while(p != NULL && sscanf(p, "%23[^=&]=%ld%n", name, &value, &n) == 2)
+	{
+		if(strcmp(name, "seq") != 0 && strcmp(name, "full") != 0)
+		{
+			for(i = 0; i < st->count && strcmp(st->name[i], name) != 0; i++)
+				;
+			if(i < FIELDS_MAX)
+			{
+				if(i == st->count)
+					snprintf(st->name[st->count++], sizeof(st->name[0]), "%s", name);
+				st->value[i] = value;
+				heartbeatFields++;
+			}
+		}
+		p = strchr(p + n, '&');
+		if(p != NULL)
+			p++;
+	}
+	snprintf(answer, size, "%lu", st->seq);
+	return 200;
+}
+
+/* Act on one request, return the HTTP status and the answer body */
+int handle(const char *method, const char *path, const char *head, const char *body, char *answer, int size)
+{
+	long serial, station, action, seq;
+	const char *id, *query;
+	int idLen, *value, i, len;
+
+	snprintf(answer, size, "Not Found");
+	if(strcmp(method, "GET") == 0 && sscanf(path, "/users/%ld/status", &serial) == 1)
+	{
+		query = strstr(path, "?seq=");
+		seq = query ? atol(query + 5) : 0;
+		value = table_get(&cardSeqs, (uint64_t)(uint32_t)serial + 1, 0);
+		if(value != NULL && seq > 0 && seq < *value) // an old record written back to the card, 0: no valid record
+		{
+			snprintf(answer, size, "Stale card record");
+			return 409;
+		}
+		value = table_get(&users, (uint64_t)(uint32_t)serial + 1, 0);
+		snprintf(answer, size, "%d", value ? *value : 0);
+		return 200;
+	}
+	if(strcmp(method, "GET") == 0 && sscanf(path, "/stats/%ld", &station) == 1 && station >= 0 && station < STATIONS)
+	{
+		snprintf(answer, size, "%lu %lu", stations[station].records, stations[station].duplicates);
+		return 200;
+	}
+	if(sscanf(path, "/stations/%ld/heartbeat", &station) == 1 && station >= 0 && station < STATIONS)
+	{
+		if(strcmp(method, "POST") == 0)
+			return heartbeat(station, body, answer, size);
+		if(states[station] == NULL)
+			return 404;
+		len = snprintf(answer, size, "seq=%lu", states[station]->seq);
+		for(i = 0; i < states[station]->count && len < size; i++)
+			len += snprintf(answer + len, size - len, "&%s=%ld", states[station]->name[i], states[station]->value[i]);
+		return 200;
+	}
+	if(strcmp(method, "POST") == 0 && strcmp(path, "/records") == 0)
+	{
+		serial = form_long(body, "userCard");
+		station = form_long(body, "stationId");
+		action = form_long(body, "action");
+		seq = form_long(body, "cardSeq");
+		if(station < 0 || station >= STATIONS || (action != 0 && action != 1))
+		{
+			snprintf(answer, size, "Bad Request");
+			return 400;
+		}
+		id = header(head, "X-Record-Id", &idLen);
+		if(id != NULL && *table_get(&records, hash_string(id, idLen), 1) != 0)
+		{
+			stations[station].duplicates++;
+			totalDuplicates++;
+		}
+		else
+		{
+			if(id != NULL)
+				*table_get(&records, hash_string(id, idLen), 1) = 1;
+			*table_get(&users, (uint64_t)(uint32_t)serial + 1, 1) = action == 0; // a borrow lets the user return next
+			if(seq > 0)
+				*table_get(&cardSeqs, (uint64_t)(uint32_t)serial + 1, 1) = seq;
+			stations[station].records++;
+			totalRecords++;
+		}
+		snprintf(answer, size, "OK");
+		return 200;
+	}
+	return 404;
+}
+
+/* Serve the requests of one kept-alive connection */
+void *connection(void *arg)
+{
+	int fd = (int)(long)arg;
+	char in[REQUEST_MAX + 1];
+	char out[ANSWER_MAX + 128];
+	char answer[ANSWER_MAX];
+	char method[8], path[128];
+	char *end, *cl;
+	int got = 0, n, head, length, code, len, fail, drop;
+	unsigned int seed = fd;
+
+	while(1)
+	{
+		in[got] = '\0';
+		end = strstr(in, "\r\n\r\n");
+		if(end == NULL)
+		{
+			if(got == REQUEST_MAX)
+				break; // headers too long
+			n = recv(fd, in + got, REQUEST_MAX - got, 0);
+			if(n <= 0)
+				break;
+			got += n;
+			continue;
+		}
+		head = end + 4 - in;
+		cl = strcasestr(in, "\r\nContent-Length:");
+		length = cl != NULL && cl < end ? atoi(cl + 17) : 0;
+		if(head + length > REQUEST_MAX)
+			break;
+		if(got < head + length)
+		{
+			n = recv(fd, in + got, REQUEST_MAX - got, 0);
+			if(n <= 0)
+				break;
+			got += n;
+			continue;
+		}
+		if(sscanf(in, "%7s %127s", method, path) != 2)
+			break;
+
+		fail = drop = 0;
+		if(strncmp(path, "/stats/", 7) != 0) // the statistics of the load generator are not under test
+		{
+			if(latencyMs > 0 || jitterMs > 0)
+				usleep((latencyMs + (jitterMs > 0 ? rand_r(&seed) % (jitterMs + 1) : 0)) * 1000);
+			fail = failPercent > 0 && rand_r(&seed) % 100 < failPercent;
+			drop = !fail && dropPercent > 0 && rand_r(&seed) % 100 < dropPercent;
+		}
+		*end = '\0'; // the body follows the blank line
+		pthread_mutex_lock(&lock);
+		requests++;
+		if(fail)
+		{
+			failed++;
+			code = 503;
+			snprintf(answer, sizeof(answer), "Service Unavailable");
+		}
+		else
+		{
+			char body[REQUEST_MAX + 1];
+
+			memcpy(body, in + head, length);
+			body[length] = '\0';
+			code = handle(method, path, in, body, answer, sizeof(answer));
+			if(drop)
+				dropped++;
+		}
+		pthread_mutex_unlock(&lock);
+		if(drop)
+			break; // acted on, but the client never hears about it
+
+		len = snprintf(out, sizeof(out), "HTTP/1.1 %d %s\r\nContent-Type: text/plain\r\nContent-Length: %d\r\n\r\n%s",
+			code, code == 200 ? "OK" : "Error", (int)strlen(answer), answer);
+		if(send(fd, out, len, MSG_NOSIGNAL) != len)
+			break;
+		got -= head + length;
+		memmove(in, in + head + length, got);
+	}
+	close(fd);
+	return NULL;
+}
+
+/* Wait for SIGINT or SIGTERM, which every other thread blocks, then print the totals and exit */
+void *report(void *arg)
+{
+	sigset_t *signals = (sigset_t *)arg;
+	int sig;
+
+	sigwait(signals, &sig);
+	pthread_mutex_lock(&lock);
+	printf("\nRequests %lu, failed %lu, dropped %lu, records %lu, duplicates %lu, heartbeats %lu with %lu fields\n",
+		requests, failed, dropped, totalRecords, totalDuplicates, heartbeats, heartbeatFields);
+	exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_in addr;
+	sigset_t signals;
+	pthread_t thread;
+	pthread_attr_t attr;
+	int port = 3999;
+	int opt, fd, client, one = 1;
+
+	while((opt = getopt(argc, argv, "p:l:j:f:d:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'p': port = atoi(optarg); break;
+			case 'l': latencyMs = atoi(optarg); break;
+			case 'j': jitterMs = atoi(optarg); break;
+			case 'f': failPercent = atoi(optarg); break;
+			case 'd': dropPercent = atoi(optarg); break;
+			default:
+				fprintf(stderr, "Usage: %s [-p port] [-l latency_ms] [-j jitter_ms] [-f fail_percent] [-d drop_percent]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if(fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 1024) != 0)
+	{
+		perror("standin");
+		return 1;
+	}
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL); // inherited by the connection threads
+	if(pthread_create(&thread, NULL, report, &signals) != 0)
+	{
+		perror("standin");
+		return 1;
+	}
+	printf("Stand-in server on port %d, latency %d+%d ms, failures %d%%, drops %d%%\n", port, latencyMs, jitterMs, failPercent, dropPercent);
+	fflush(stdout);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&attr, 64 * 1024);
+	while(1)
+	{
+		client = accept(fd, NULL, NULL);
+		if(client < 0)
+			continue;
+		setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if(pthread_create(&thread, &attr, connection, (void *)(long)client) != 0)
+			close(client);
+	}
+}